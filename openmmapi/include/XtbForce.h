@@ -35,6 +35,7 @@
 #include "openmm/Context.h"
 #include "openmm/Force.h"
 #include "internal/windowsExportXtb.h"
+#include <string>
 #include <vector>
 
 namespace XtbPlugin {
@@ -55,6 +56,20 @@ public:
         GFN2xTB = 1,
         GFNFF = 2
     };
+    /**
+     * This is an enumeration of ways to combine the energies and forces of multiple electronic states
+     * into the ones applied to the System.
+     */
+    enum StateCombination {
+        /**
+         * Apply the weighted sum of the energies and forces of all states.
+         */
+        WeightedSum = 0,
+        /**
+         * Apply the energy and forces of whichever state has the lowest energy.
+         */
+        MinimumEnergy = 1
+    };
     /**
      * Create a XtbForce.
      *
@@ -76,21 +91,128 @@ public:
      */
     void setMethod(Method method);
     /**
-     * Get the total charge of the XTB system.
+     * Get the total charge of the XTB system.  If there are multiple electronic states, this is the
+     * charge of state 0.
      */
     double getCharge() const;
     /**
-     * Set the total charge of the XTB system.
+     * Set the total charge of the XTB system.  If there are multiple electronic states, this is the
+     * charge of state 0.
      */
     void setCharge(double charge);
     /**
-     * Get the spin multiplicity of the XTB system.
+     * Get the spin multiplicity of the XTB system.  If there are multiple electronic states, this is the
+     * multiplicity of state 0.
      */
     int getMultiplicity() const;
     /**
-     * Set the spin multiplicity of the XTB system.
+     * Set the spin multiplicity of the XTB system.  If there are multiple electronic states, this is the
+     * multiplicity of state 0.
      */
     void setMultiplicity(int multiplicity);
+    /**
+     * Get the number of electronic states that are computed.  There is always at least one state,
+     * whose charge and multiplicity are the ones returned by getCharge() and getMultiplicity().
+     */
+    int getNumElectronicStates() const;
+    /**
+     * Add an electronic state to be computed.  Every state is computed for the same geometry at every
+     * step, and the states are computed in parallel, with the processors divided between them.  The energy
+     * and forces applied to the System are determined by the state combination.
+     *
+     * @param charge        the total charge of the state
+     * @param multiplicity  the spin multiplicity of the state
+     * @param weight        the weight of the state when using the WeightedSum combination
+     * @return the index of the state that was added
+     */
+    int addElectronicState(double charge, int multiplicity, double weight);
+    /**
+     * Get the parameters of an electronic state.
+     *
+     * @param index              the index of the state
+     * @param[out] charge        the total charge of the state
+     * @param[out] multiplicity  the spin multiplicity of the state
+     * @param[out] weight        the weight of the state when using the WeightedSum combination
+     */
+    void getElectronicStateParameters(int index, double& charge, int& multiplicity, double& weight) const;
+    /**
+     * Set the parameters of an electronic state.
+     *
+     * @param index         the index of the state
+     * @param charge        the total charge of the state
+     * @param multiplicity  the spin multiplicity of the state
+     * @param weight        the weight of the state when using the WeightedSum combination
+     */
+    void setElectronicStateParameters(int index, double charge, int multiplicity, double weight);
+    /**
+     * Get how the energies and forces of the electronic states are combined.
+     */
+    StateCombination getStateCombination() const;
+    /**
+     * Set how the energies and forces of the electronic states are combined.
+     */
+    void setStateCombination(StateCombination combination);
+    /**
+     * Get the energy of each electronic state, as computed in the most recent evaluation in a Context.
+     * If a scale parameter is used, the energies are multiplied by its value in that evaluation.
+     *
+     * @param context        the Context to get the energies from
+     * @param[out] energies  the energy of each state in kJ/mol
+     */
+    void getElectronicStateEnergiesInContext(const OpenMM::Context& context, std::vector<double>& energies) const;
+    /**
+     * Get the forces for one electronic state, as computed in the most recent evaluation in a Context.
+     * If a scale parameter is used, the forces are multiplied by its value in that evaluation.
+     *
+     * @param context      the Context to get the forces from
+     * @param index        the index of the state
+     * @param[out] forces  the force on every particle in the System in kJ/mol/nm.  Particles this force
+     *                     is not applied to have a force of zero.
+     */
+    void getElectronicStateForcesInContext(const OpenMM::Context& context, int index, std::vector<OpenMM::Vec3>& forces) const;
+    /**
+     * Get the virial computed by XTB in the most recent evaluation in a Context.  This is only available
+     * when periodic boundary conditions are used.  If there are multiple electronic states, it is combined
+     * in the same way as the energies.  If a scale parameter is used, the virial is multiplied by its value
+     * in that evaluation.
+     *
+     * @param context       the Context to get the virial from
+     * @param[out] virial   the 3x3 virial matrix in kJ/mol, stored in row major order
+     */
+    void getVirialInContext(const OpenMM::Context& context, std::vector<double>& virial) const;
+    /**
+     * Get the partial charges computed by XTB in the most recent evaluation in a Context.  If there are
+     * multiple electronic states, they are combined in the same way as the energies.  Link atoms added
+     * for boundary bonds are not included.  The charges are not affected by the scale parameter.  If XTB
+     * was skipped in the most recent evaluation because the scale parameter was 0, this throws an
+     * exception.
+     *
+     * @param context       the Context to get the charges from
+     * @param[out] charges  the charge of each particle this force is applied to, in the same order as
+     *                      getParticleIndices(), measured in units of the proton charge
+     */
+    void getChargesInContext(const OpenMM::Context& context, std::vector<double>& charges) const;
+    /**
+     * Get statistics about the adaptive method in a Context.  This is only available when the adaptive
+     * method is used.
+     *
+     * @param context                   the Context to get the statistics from
+     * @param[out] cheapEvaluations     the number of times the cheap method has been computed
+     * @param[out] accurateEvaluations  the number of times the accurate method has been computed
+     * @param[out] cheapTime            the total time spent computing the cheap method, in seconds
+     * @param[out] accurateTime         the total time spent computing the accurate method, in seconds
+     */
+    void getAdaptiveMethodStatisticsInContext(const OpenMM::Context& context, int& cheapEvaluations, int& accurateEvaluations,
+                                              double& cheapTime, double& accurateTime) const;
+    /**
+     * Get the steps at which the adaptive method decided to switch methods in a Context.  Switches
+     * alternate between the two methods, starting with a switch from the cheap method to the accurate one.
+     * This is only available when the adaptive method is used.
+     *
+     * @param context     the Context to get the switches from
+     * @param[out] steps  the step at which each switch was decided
+     */
+    void getAdaptiveMethodSwitchesInContext(const OpenMM::Context& context, std::vector<long long>& steps) const;
     /**
      * Get the indices of the particles this force is applied to.
      */
@@ -107,6 +229,45 @@ public:
      * Set the atomic numbers of the particles this force is applied to.
      */
     void setAtomicNumbers(const std::vector<int>& numbers);
+    /**
+     * Get the number of boundary bonds.
+     */
+    int getNumBoundaryBonds() const;
+    /**
+     * Add a boundary bond.  This is a covalent bond between a particle this force is applied to (the QM
+     * atom) and a particle it is not applied to (the MM atom).  A hydrogen link atom is added to the XTB
+     * calculation to cap the QM atom.  It is placed on the line between the two atoms at
+     *
+     * r_link = r_QM + scale*(r_MM - r_QM)
+     *
+     * The link atom is not a particle in the System.  The force on it is distributed between the QM and
+     * MM atoms according to the chain rule.  The default scale factor is approximately the ratio of a C-H
+     * bond length to a C-C bond length.  Boundary bonds cannot be combined with domain decomposition.
+     *
+     * @param qmParticle  the index within the System of the QM atom
+     * @param mmParticle  the index within the System of the MM atom
+     * @param scale       the position of the link atom along the bond, as a fraction of the bond length
+     * @return the index of the boundary bond that was added
+     */
+    int addBoundaryBond(int qmParticle, int mmParticle, double scale=0.709);
+    /**
+     * Get the parameters of a boundary bond.
+     *
+     * @param index            the index of the boundary bond
+     * @param[out] qmParticle  the index within the System of the QM atom
+     * @param[out] mmParticle  the index within the System of the MM atom
+     * @param[out] scale       the position of the link atom along the bond, as a fraction of the bond length
+     */
+    void getBoundaryBondParameters(int index, int& qmParticle, int& mmParticle, double& scale) const;
+    /**
+     * Set the parameters of a boundary bond.
+     *
+     * @param index       the index of the boundary bond
+     * @param qmParticle  the index within the System of the QM atom
+     * @param mmParticle  the index within the System of the MM atom
+     * @param scale       the position of the link atom along the bond, as a fraction of the bond length
+     */
+    void setBoundaryBondParameters(int index, int qmParticle, int mmParticle, double scale);
     /**
      * Get whether this force uses periodic boundary conditions.
      */
@@ -115,14 +276,316 @@ public:
      * Set whether this force uses periodic boundary conditions.
      */
     void setUsesPeriodicBoundaryConditions(bool periodic);
+    /**
+     * Get the SCC accuracy.  Larger values mean looser convergence.  The default is 1.0, which is XTB's
+     * default accuracy.  This is used before the first phase of the schedule begins.
+     */
+    double getAccuracy() const;
+    /**
+     * Set the SCC accuracy.  Larger values mean looser convergence.  This has no effect for GFNFF, which
+     * does not use an SCC procedure.  This is used before the first phase of the schedule begins.
+     */
+    void setAccuracy(double accuracy);
+    /**
+     * Get the maximum number of SCC iterations.  The default is 250.  This is used before the first phase
+     * of the schedule begins.
+     */
+    int getMaxIterations() const;
+    /**
+     * Set the maximum number of SCC iterations.  This has no effect for GFNFF.  This is used before the
+     * first phase of the schedule begins.
+     */
+    void setMaxIterations(int iterations);
+    /**
+     * Get the electronic temperature used for Fermi smearing, measured in K.  The default is 300 K.  This
+     * is used before the first phase of the schedule begins.
+     */
+    double getElectronicTemperature() const;
+    /**
+     * Set the electronic temperature used for Fermi smearing, measured in K.  This has no effect for
+     * GFNFF.  This is used before the first phase of the schedule begins.
+     */
+    void setElectronicTemperature(double temperature);
+    /**
+     * Get the number of phases in the schedule.
+     */
+    int getNumSchedulePhases() const;
+    /**
+     * Add a phase to the schedule.  The schedule lets the SCC settings change as a simulation progresses.
+     * For example, you might use loose settings during equilibration and tighter ones for production.
+     * Each phase begins at the specified step and lasts until the next phase begins.  Before the first
+     * phase, the values returned by getAccuracy(), getMaxIterations(), and getElectronicTemperature() are
+     * used.  The schedule can be changed during a simulation by calling updateParametersInContext().
+     *
+     * @param startStep              the step at which the phase begins
+     * @param accuracy               the SCC accuracy to use during the phase
+     * @param maxIterations          the maximum number of SCC iterations to use during the phase
+     * @param electronicTemperature  the electronic temperature to use during the phase, measured in K
+     * @return the index of the phase that was added
+     */
+    int addSchedulePhase(long long startStep, double accuracy, int maxIterations, double electronicTemperature);
+    /**
+     * Get the parameters of a phase of the schedule.
+     *
+     * @param index                       the index of the phase
+     * @param[out] startStep              the step at which the phase begins
+     * @param[out] accuracy               the SCC accuracy to use during the phase
+     * @param[out] maxIterations          the maximum number of SCC iterations to use during the phase
+     * @param[out] electronicTemperature  the electronic temperature to use during the phase, measured in K
+     */
+    void getSchedulePhaseParameters(int index, long long& startStep, double& accuracy, int& maxIterations, double& electronicTemperature) const;
+    /**
+     * Set the parameters of a phase of the schedule.
+     *
+     * @param index                  the index of the phase
+     * @param startStep              the step at which the phase begins
+     * @param accuracy               the SCC accuracy to use during the phase
+     * @param maxIterations          the maximum number of SCC iterations to use during the phase
+     * @param electronicTemperature  the electronic temperature to use during the phase, measured in K
+     */
+    void setSchedulePhaseParameters(int index, long long startStep, double accuracy, int maxIterations, double electronicTemperature);
+    /**
+     * Get the reduced SCC accuracy used on steps between full accuracy steps.  Larger values mean looser
+     * convergence.  XTB's default accuracy is 1.0.  A value of 0 (the default) means every step uses the
+     * default accuracy.
+     */
+    double getReducedAccuracy() const;
+    /**
+     * Set the reduced SCC accuracy used on steps between full accuracy steps.  This trades accuracy for
+     * speed: a looser convergence threshold saves SCC iterations, but the forces on those steps are less
+     * accurate, which can cause the energy to drift in constant energy simulations.  Each step still starts
+     * from the converged wavefunction of the previous one, but no history of charges is kept and nothing is
+     * extrapolated.  The default accuracy is used every getFullAccuracyInterval() steps, and for any
+     * calculation that does not have a previous wavefunction to start from.  If the current accuracy (set
+     * with setAccuracy() or by the schedule) is looser than this, it is used instead.  This has no effect
+     * for GFNFF, which does not use an SCC procedure.
+     *
+     * @param accuracy   the accuracy to use between full accuracy steps, or 0 to disable this option
+     */
+    void setReducedAccuracy(double accuracy);
+    /**
+     * Get the interval (in time steps) at which the default SCC accuracy is used when a reduced
+     * accuracy has been set.
+     */
+    int getFullAccuracyInterval() const;
+    /**
+     * Set the interval (in time steps) at which the default SCC accuracy is used when a reduced
+     * accuracy has been set.
+     */
+    void setFullAccuracyInterval(int interval);
+    /**
+     * Get whether the system is divided into cells that are computed separately.
+     */
+    bool getUsesDomainDecomposition() const;
+    /**
+     * Set whether the system is divided into cells that are computed separately.  This lets large
+     * periodic systems be simulated at a cost that scales linearly with the number of atoms, and lets
+     * the cells be computed in parallel.  Each cell is computed as a nonperiodic calculation containing
+     * the atoms inside it plus all atoms within the buffer width of it, and only the forces on the atoms
+     * inside the cell are used.  The energy cannot be divided up consistently with the forces, so only
+     * forces are computed.  Requesting the energy of this force, for example with getState() or
+     * LocalEnergyMinimizer, throws an exception.  Every cell is computed as neutral, so the results are
+     * only accurate when the atoms of each cell and its buffer carry little net charge.
+     *
+     * The errors introduced by this approximation depend on the buffer width, which must be large
+     * compared to the range of the interactions.  The cells cut through covalent bonds, so the buffer must
+     * also be wide enough that the bonded topology GFN-FF assigns to the atoms inside a cell is complete.
+     * Domain decomposition requires the GFNFF method, periodic boundary conditions, a charge of 0, and a
+     * single electronic state.  Because no energy is computed, it cannot be used with a Monte Carlo
+     * barostat or when computing the derivative of the scale parameter.  The cells are computed in
+     * parallel.  If OMP_NUM_THREADS is set, each cell uses that many threads.  Otherwise the processors are
+     * divided evenly between the cells.
+     */
+    void setUsesDomainDecomposition(bool use);
+    /**
+     * Get the parameters used for domain decomposition.
+     *
+     * @param[out] cellSize     the minimum width of each cell, measured in nm
+     * @param[out] bufferWidth  the width of the buffer around each cell, measured in nm
+     */
+    void getDomainDecompositionParameters(double& cellSize, double& bufferWidth) const;
+    /**
+     * Set the parameters used for domain decomposition.  The periodic box is divided into as many cells
+     * along each axis as will fit without any cell being narrower than cellSize.  If the box is too narrow
+     * for more than one cell along an axis, periodic images of the atoms are used to fill the buffer on
+     * that axis.
+     *
+     * @param cellSize     the minimum width of each cell, measured in nm
+     * @param bufferWidth  the width of the buffer around each cell, measured in nm
+     */
+    void setDomainDecompositionParameters(double cellSize, double bufferWidth);
+    /**
+     * Get whether the method is chosen adaptively based on an estimate of the force error.
+     */
+    bool getUsesAdaptiveMethod() const;
+    /**
+     * Set whether the method is chosen adaptively based on an estimate of the force error.  When this is
+     * enabled, the method returned by getMethod() is treated as a cheap method that is used most of the
+     * time, and getAdaptiveMethodParameters() specifies a more accurate method.  Both are computed every
+     * checkInterval steps, and the RMS difference between their forces is used as an estimate of the error
+     * in the cheap method.  When it exceeds the threshold, the simulation switches to the accurate method.
+     * It switches back to the cheap method once the error has been below half the threshold for three
+     * consecutive checks.  To avoid sudden jumps in the forces, each switch is done gradually by linearly
+     * blending the two methods over blendSteps steps.  The energy is not conserved while blending.
+     *
+     * The adaptive method requires a single electronic state, and cannot be combined with domain
+     * decomposition.
+     */
+    void setUsesAdaptiveMethod(bool use);
+    /**
+     * Get the parameters used for the adaptive method.
+     *
+     * @param[out] accurateMethod  the method to switch to when the error is large
+     * @param[out] checkInterval   the interval (in time steps) at which the error is checked
+     * @param[out] forceThreshold  the RMS force error above which the accurate method is used, in kJ/mol/nm
+     * @param[out] blendSteps      the number of steps over which to blend the methods when switching
+     */
+    void getAdaptiveMethodParameters(Method& accurateMethod, int& checkInterval, double& forceThreshold, int& blendSteps) const;
+    /**
+     * Set the parameters used for the adaptive method.
+     *
+     * @param accurateMethod  the method to switch to when the error is large
+     * @param checkInterval   the interval (in time steps) at which the error is checked
+     * @param forceThreshold  the RMS force error above which the accurate method is used, in kJ/mol/nm
+     * @param blendSteps      the number of steps over which to blend the methods when switching.  If
+     *                        this is 0, methods are switched immediately.
+     */
+    void setAdaptiveMethodParameters(Method accurateMethod, int checkInterval, double forceThreshold, int blendSteps);
+    /**
+     * Get the name of the global parameter that scales the energy and forces.  If this is an empty string,
+     * they are not scaled.
+     */
+    const std::string& getScaleParameter() const;
+    /**
+     * Set the name of a global parameter to scale the energy and forces by.  The Context defines the
+     * parameter, with the value returned by getScaleParameterDefaultValue(), so it can be changed with
+     * setParameter() like any other global parameter.  This makes it possible to switch the force on
+     * and off alchemically, for example to compute a free energy correction, using a single Context for
+     * every window.  When the parameter is 0 and its derivative is not being computed, XTB is not called
+     * at all.  Pass an empty string to disable scaling.  The energies, forces, and virial returned by the
+     * *InContext() methods are scaled in the same way, but the charges are not.
+     *
+     * The parameter cannot be changed with updateParametersInContext().
+     */
+    void setScaleParameter(const std::string& name);
+    /**
+     * Get the default value of the global parameter that scales the energy and forces.
+     */
+    double getScaleParameterDefaultValue() const;
+    /**
+     * Set the default value of the global parameter that scales the energy and forces.
+     */
+    void setScaleParameterDefaultValue(double value);
+    /**
+     * Request that this Force compute the derivative of its energy with respect to a global parameter.
+     * The only parameter this Force depends on is the scale parameter, so name must be the value returned
+     * by getScaleParameter().  The derivative is the unscaled energy.  It is reported through
+     * State::getEnergyParameterDerivatives(), like the derivatives computed by OpenMM's custom forces.
+     * This means XTB must be called even when the parameter is 0.  Derivatives are only supported on the
+     * Reference and CPU platforms, and creating a Context on any other platform throws an exception.
+     *
+     * The derivatives cannot be changed with updateParametersInContext().
+     *
+     * @param name    the name of the parameter
+     */
+    void addEnergyParameterDerivative(const std::string& name);
+    /**
+     * Get the number of global parameters with respect to which the derivative of the energy
+     * should be computed.
+     */
+    int getNumEnergyParameterDerivatives() const;
+    /**
+     * Get the name of a global parameter with respect to which this Force should compute the
+     * derivative of the energy.
+     *
+     * @param index     the index of the parameter derivative, between 0 and getNumEnergyParameterDerivatives()
+     * @return the parameter name
+     */
+    const std::string& getEnergyParameterDerivativeName(int index) const;
+    /**
+     * Update the parameters in a Context to match those stored in this Force object.  This method provides
+     * an efficient method to update certain parameters in an existing Context without needing to reinitialize
+     * it.  Simply call the setter methods to modify the parameters, then call updateParametersInContext()
+     * to copy them over to the Context.
+     *
+     * Only the parts of the XTB calculation affected by the changes are rebuilt.  Changing the charge
+     * or multiplicity of a state creates a new molecule for it, and changing the method loads new
+     * parameters.  States that are not affected continue to use the wavefunction from the previous
+     * step as their initial guess.  Changing the atomic numbers or whether periodic boundary conditions
+     * are used, or adding or removing boundary bonds, rebuilds every state.  Changing the particles of a
+     * boundary bond or its scale factor does not require rebuilding anything.  Changing any domain
+     * decomposition setting rebuilds every cell.  The statistics and current blend of the adaptive method
+     * are preserved.
+     */
+    void updateParametersInContext(OpenMM::Context& context);
 protected:
     OpenMM::ForceImpl* createImpl() const;
 private:
+    class ElectronicStateInfo;
+    class BoundaryBondInfo;
+    class SchedulePhaseInfo;
     Method method;
-    double charge;
-    int multiplicity;
+    StateCombination stateCombination;
+    std::vector<ElectronicStateInfo> states;
+    std::vector<BoundaryBondInfo> boundaryBonds;
+    std::vector<SchedulePhaseInfo> schedule;
     bool periodic;
     std::vector<int> particleIndices, atomicNumbers;
+    double accuracy, electronicTemperature, reducedAccuracy;
+    int maxIterations, fullAccuracyInterval;
+    bool useDomainDecomposition;
+    double cellSize, bufferWidth;
+    bool useAdaptiveMethod;
+    Method accurateMethod;
+    int checkInterval, blendSteps;
+    double forceThreshold;
+    std::string scaleParameter;
+    double scaleParameterDefaultValue;
+    std::vector<std::string> energyParameterDerivatives;
+};
+
+/**
+ * This is an internal class used to record information about an electronic state.
+ * @private
+ */
+class XtbForce::ElectronicStateInfo {
+public:
+    double charge, weight;
+    int multiplicity;
+    ElectronicStateInfo() : charge(0.0), weight(1.0), multiplicity(1) {
+    }
+    ElectronicStateInfo(double charge, int multiplicity, double weight) : charge(charge), weight(weight), multiplicity(multiplicity) {
+    }
+};
+
+/**
+ * This is an internal class used to record information about a boundary bond.
+ * @private
+ */
+class XtbForce::BoundaryBondInfo {
+public:
+    int qmParticle, mmParticle;
+    double scale;
+    BoundaryBondInfo() : qmParticle(-1), mmParticle(-1), scale(0.709) {
+    }
+    BoundaryBondInfo(int qmParticle, int mmParticle, double scale) : qmParticle(qmParticle), mmParticle(mmParticle), scale(scale) {
+    }
+};
+
+/**
+ * This is an internal class used to record information about a phase of the schedule.
+ * @private
+ */
+class XtbForce::SchedulePhaseInfo {
+public:
+    long long startStep;
+    double accuracy, electronicTemperature;
+    int maxIterations;
+    SchedulePhaseInfo() : startStep(0), accuracy(1.0), electronicTemperature(300.0), maxIterations(250) {
+    }
+    SchedulePhaseInfo(long long startStep, double accuracy, int maxIterations, double electronicTemperature) :
+            startStep(startStep), accuracy(accuracy), electronicTemperature(electronicTemperature), maxIterations(maxIterations) {
+    }
 };
 
 } // namespace XtbPlugin
@@ -0,0 +1,103 @@
+#ifndef OPENMM_XTBTRACER_H_
+#define OPENMM_XTBTRACER_H_
+
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2023 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/windowsExportXtb.h"
+#include <string>
+
+namespace XtbPlugin {
+
+/**
+ * This class records a timeline of the work done by XtbForce, such as gathering positions, building
+ * the XTB molecule, and performing the single point calculation.  It is useful for understanding how
+ * XtbForce interacts with the integrator and other forces.  Tracing is disabled by default.  When it
+ * is enabled, every XtbForce in every Context records timestamped events tagged with the Context and
+ * step they belong to.  Call writeTrace() to save them in the Chrome trace format, which can be viewed
+ * with chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Events are stored in a fixed size buffer for each thread.  If too many events are recorded without
+ * calling writeTrace(), later events are discarded.  Each XtbForce is identified in the trace by an ID
+ * it is assigned when it is initialized in a Context.
+ */
+
+class OPENMM_EXPORT_XTB XtbTracer {
+public:
+    /**
+     * Set whether events should be recorded.
+     */
+    static void setEnabled(bool enabled);
+    /**
+     * Get whether events are being recorded.
+     */
+    static bool isEnabled();
+    /**
+     * Write all events recorded so far to a file in the Chrome trace JSON format.  The events are then
+     * discarded, so each call writes only the events recorded since the previous call to writeTrace()
+     * or clear().  During a long simulation, call it periodically with a different filename each time
+     * to keep memory use bounded.
+     *
+     * @param filename    the file to write
+     */
+    static void writeTrace(const std::string& filename);
+    /**
+     * Discard all events that have been recorded.
+     */
+    static void clear();
+    /**
+     * Get the number of events that were discarded because a buffer was full.
+     */
+    static long long getNumDroppedEvents();
+    /**
+     * Create a new ID to identify a Context in traces.  Each XtbForce calls this once when it is
+     * initialized in a Context.  IDs are never reused.
+     */
+    static int createContextId();
+    /**
+     * A Phase records a single event covering the time from when it is created until it is destroyed.
+     * It is used internally by XtbForce.
+     */
+    class OPENMM_EXPORT_XTB Phase {
+    public:
+        Phase(const char* name, int contextId, long long step);
+        ~Phase();
+    private:
+        const char* name;
+        int contextId;
+        long long step, startTime;
+    };
+};
+
+} // namespace XtbPlugin
+
+#endif /*OPENMM_XTBTRACER_H_*/
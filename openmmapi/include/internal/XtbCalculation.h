@@ -0,0 +1,176 @@
+#ifndef OPENMM_XTBCALCULATION_H_
+#define OPENMM_XTBCALCULATION_H_
+
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2023 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "XtbForce.h"
+#include "xtb.h"
+#include <vector>
+
+namespace XtbPlugin {
+
+/**
+ * This class holds the XTB objects for one calculation: the environment, molecule, calculator, and
+ * results.  They persist between calls to compute(), so the molecule and parameters are only set up
+ * once and each calculation starts from the wavefunction of the previous one.
+ *
+ * Different XtbCalculations may call compute() on different threads at the same time.  This assumes
+ * that XTB's C API keeps everything a calculation modifies in the objects passed to it, so two
+ * calculations that share no objects do not interfere.  XtbForce relies on this to compute electronic
+ * states and domain decomposition cells in parallel.  The assumption is not verified: XTB does not
+ * document its C API as reentrant, and tests that compare parallel results to serial ones can only
+ * show that a particular run was unaffected.  If it turns out not to hold, those calls must be
+ * serialized.
+ */
+
+class OPENMM_EXPORT_XTB XtbCalculation {
+public:
+    /**
+     * Create an XtbCalculation.
+     *
+     * @param method        the method to use for computing forces and energy
+     * @param charge        the total charge
+     * @param multiplicity  the spin multiplicity
+     * @param periodic      whether to apply periodic boundary conditions
+     * @param numbers       the atomic numbers of the atoms
+     */
+    XtbCalculation(XtbForce::Method method, double charge, int multiplicity, bool periodic, const std::vector<int>& numbers);
+    ~XtbCalculation();
+    /**
+     * Get whether a wavefunction from a previous calculation is available.  If so, the next call
+     * to compute() will start from it.
+     */
+    bool hasWavefunction() const {
+        return wavefunctionValid;
+    }
+    /**
+     * Change the method.  The parameters for the new method are loaded on the next call to compute().
+     */
+    void setMethod(XtbForce::Method method);
+    /**
+     * Change the charge and multiplicity.  The molecule is rebuilt on the next call to compute().
+     */
+    void setElectronicState(double charge, int multiplicity);
+    /**
+     * Set the SCC accuracy to use for subsequent calculations.
+     */
+    void setAccuracy(double accuracy);
+    /**
+     * Set the maximum number of SCC iterations and the electronic temperature (in K) to use for
+     * subsequent calculations.
+     */
+    void setSCCParameters(int maxIterations, double electronicTemperature);
+    /**
+     * Set the number of OpenMP threads XTB should use for subsequent calculations.  A value of 0 (the
+     * default) leaves the OpenMP settings of the calling thread unchanged.  This has no effect if the
+     * plugin was built without OpenMP.
+     */
+    void setNumThreads(int numThreads);
+    /**
+     * Decide how to divide the processors between calculations that can run at the same time.  If
+     * OMP_NUM_THREADS is set, each calculation uses that many threads, and only as many calculations
+     * run at once as there are processors for.  Otherwise up to one calculation runs on each processor,
+     * and the processors are divided evenly between the ones that run.
+     *
+     * @param numCalculations              the number of calculations that could run at once
+     * @param[out] numWorkers              the number of calculations to run at once
+     * @param[out] threadsPerCalculation   the number of OpenMP threads each calculation should use
+     */
+    static void selectNumThreads(int numCalculations, int& numWorkers, int& threadsPerCalculation);
+    /**
+     * Perform a single point calculation.
+     *
+     * @param positions   the atom positions in bohr, in the order x1, y1, z1, x2, ...
+     * @param box         the periodic box vectors in bohr
+     * @param contextId   the ID used to identify the Context in traces
+     * @param step        the current step, for tracing
+     */
+    void compute(const double* positions, const double* box, int contextId, long long step);
+    /**
+     * Get the energy computed by the last call to compute(), in Hartree.
+     */
+    double getEnergy() const {
+        return energy;
+    }
+    /**
+     * Get the gradient computed by the last call to compute(), in Hartree/bohr.
+     */
+    const std::vector<double>& getGradient() const {
+        return gradient;
+    }
+    /**
+     * Get the virial computed by the last call to compute(), in Hartree.  It is stored as a 3x3
+     * matrix in row major order.  This is only computed when periodic boundary conditions are used.
+     */
+    const std::vector<double>& getVirial() const {
+        return virial;
+    }
+    /**
+     * Get the partial charges computed by the last call to compute(), in elementary charge units.
+     */
+    const std::vector<double>& getCharges() const {
+        return charges;
+    }
+    /**
+     * Save a copy of the current results and wavefunction.  They can later be restored with
+     * restoreSnapshot().  Any previous snapshot is discarded.
+     */
+    void saveSnapshot();
+    /**
+     * Restore the results and wavefunction saved by saveSnapshot().  The snapshot is consumed.
+     */
+    void restoreSnapshot();
+    /**
+     * Discard the results saved by saveSnapshot() without restoring them.
+     */
+    void discardSnapshot();
+private:
+    XtbCalculation(const XtbCalculation&);
+    XtbCalculation& operator=(const XtbCalculation&);
+    void checkErrors();
+    void resetResults();
+    XtbForce::Method method;
+    double charge, energy, accuracy, appliedAccuracy, electronicTemperature, appliedElectronicTemperature, snapshotEnergy;
+    int multiplicity, maxIterations, appliedMaxIterations, numThreads;
+    bool periodic, needParameters, wavefunctionValid;
+    std::vector<int> numbers;
+    std::vector<double> gradient, virial, charges, snapshotGradient, snapshotVirial, snapshotCharges;
+    xtb_TEnvironment env;
+    xtb_TCalculator calc;
+    xtb_TResults res, snapshotRes;
+    xtb_TMolecule mol;
+};
+
+} // namespace XtbPlugin
+
+#endif /*OPENMM_XTBCALCULATION_H_*/
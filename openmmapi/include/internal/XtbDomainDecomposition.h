@@ -0,0 +1,129 @@
+#ifndef OPENMM_XTBDOMAINDECOMPOSITION_H_
+#define OPENMM_XTBDOMAINDECOMPOSITION_H_
+
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2023 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "XtbForce.h"
+#include "internal/XtbCalculation.h"
+#include "openmm/internal/ThreadPool.h"
+#include <vector>
+
+namespace XtbPlugin {
+
+/**
+ * This class computes the forces for a large periodic system by splitting it into cells.  Each cell is
+ * computed as a separate nonperiodic GFN-FF calculation containing the atoms inside it (the interior atoms)
+ * plus all atoms within a buffer distance of it.  Only the forces on interior atoms are used.  When the box
+ * has only one cell along an axis, the buffer is filled with periodic images of the cell's own atoms.
+ *
+ * There is no way to partition the energy consistently with the forces, so no energy is computed.  There
+ * is also no way to partition the charge, so every cell is computed as neutral.  The cells are computed in
+ * parallel, with the processors divided between them as described in XtbCalculation::selectNumThreads().
+ *
+ * The assignment of atoms to cells is only updated when some atom has moved more than half a skin distance
+ * since the last assignment, and atoms within the buffer distance plus the skin distance are included.  When
+ * the assignment changes, only the cells whose atoms changed are rebuilt.  The others keep their molecule,
+ * parameters, and wavefunction.
+ */
+
+class OPENMM_EXPORT_XTB XtbDomainDecomposition {
+public:
+    /**
+     * Create an XtbDomainDecomposition.
+     *
+     * @param method        the method to use for computing forces.  This must be GFNFF.
+     * @param multiplicity  the spin multiplicity of each cell
+     * @param numbers       the atomic numbers of the atoms
+     * @param cellSize      the minimum width of a cell, in nm
+     * @param bufferWidth   the width of the buffer around each cell, in nm
+     */
+    XtbDomainDecomposition(XtbForce::Method method, int multiplicity, const std::vector<int>& numbers, double cellSize, double bufferWidth);
+    ~XtbDomainDecomposition();
+    /**
+     * Compute the gradient.
+     *
+     * @param positions   the atom positions in bohr, in the order x1, y1, z1, x2, ...
+     * @param box         the periodic box vectors in bohr
+     * @param accuracy    the SCC accuracy to use for cells that cannot start from a previous wavefunction
+     * @param reducedAccuracy  the SCC accuracy to use for cells that can start from the wavefunction
+     *                         of a previous calculation
+     * @param contextId   the ID used to identify the Context in traces
+     * @param step        the current step, for tracing
+     */
+    void compute(const std::vector<double>& positions, const double* box, double accuracy, double reducedAccuracy, int contextId, long long step);
+    /**
+     * Set the maximum number of SCC iterations and the electronic temperature (in K) to use for
+     * subsequent calculations.
+     */
+    void setSCCParameters(int maxIterations, double electronicTemperature);
+    /**
+     * Get the gradient computed by the last call to compute(), in Hartree/bohr.
+     */
+    const std::vector<double>& getGradient() const {
+        return gradient;
+    }
+    /**
+     * Get the partial charges computed by the last call to compute().  Each atom takes its charge from
+     * the cell it is an interior atom of.
+     */
+    const std::vector<double>& getCharges() const {
+        return charges;
+    }
+private:
+    struct Cell {
+        Cell() : numInterior(0), calc(nullptr) {
+        }
+        int index[3], numInterior;
+        std::vector<int> atoms, images;
+        std::vector<double> positions;
+        XtbCalculation* calc;
+    };
+    XtbDomainDecomposition(const XtbDomainDecomposition&);
+    XtbDomainDecomposition& operator=(const XtbDomainDecomposition&);
+    bool needsAssignment(const double* box) const;
+    void assignCells(const double* box);
+    void deleteCells();
+    XtbForce::Method method;
+    int multiplicity, maxIterations, threadsPerCell;
+    std::vector<int> numbers;
+    double cellSize, bufferWidth, skin, electronicTemperature;
+    int numCells[3];
+    double box[9];
+    std::vector<Cell> cells;
+    std::vector<double> fractional, assignedFractional, gradient, charges;
+    OpenMM::ThreadPool* threads;
+};
+
+} // namespace XtbPlugin
+
+#endif /*OPENMM_XTBDOMAINDECOMPOSITION_H_*/
@@ -33,9 +33,13 @@
  * -------------------------------------------------------------------------- */
 
 #include "XtbForce.h"
+#include "internal/XtbCalculation.h"
+#include "internal/XtbDomainDecomposition.h"
 #include "openmm/internal/ContextImpl.h"
 #include "openmm/internal/CustomCPPForceImpl.h"
-#include "xtb.h"
+#include "openmm/internal/ThreadPool.h"
+#include <map>
+#include <string>
 
 namespace XtbPlugin {
 
@@ -51,19 +55,75 @@ public:
     const XtbForce& getOwner() const {
         return owner;
     }
+    double calcForcesAndEnergy(OpenMM::ContextImpl& context, bool includeForces, bool includeEnergy, int groups);
     double computeForce(OpenMM::ContextImpl& context, const std::vector<OpenMM::Vec3>& positions, std::vector<OpenMM::Vec3>& forces);
+    std::map<std::string, double> getDefaultParameters();
+    void updateParametersInContext(OpenMM::ContextImpl& context);
+    void getStateEnergies(std::vector<double>& energies) const;
+    void getStateForces(int index, std::vector<OpenMM::Vec3>& forces) const;
+    void getVirial(std::vector<double>& virial) const;
+    void getCharges(std::vector<double>& charges) const;
+    void getAdaptiveStatistics(int& cheapEvaluations, int& accurateEvaluations, double& cheapTime, double& accurateTime) const;
+    void getAdaptiveSwitches(std::vector<long long>& steps) const;
 private:
-    void checkErrors();
+    /**
+     * This records the configuration for which a set of results was computed.
+     */
+    struct CachedConfiguration {
+        std::vector<double> positions;
+        double box[9];
+        bool fullAccuracy;
+        int schedulePhase;
+        bool matchesBox(const double* box) const;
+        bool matches(const std::vector<double>& positions, const double* box, bool needFullAccuracy, int schedulePhase) const;
+    };
+    /**
+     * This records the SCC settings for one phase of the schedule.
+     */
+    struct SchedulePhase {
+        long long startStep;
+        double accuracy, electronicTemperature;
+        int maxIterations;
+    };
+    void loadSchedule();
+    int selectSCCParameters(long long step, double& accuracy, int& maxIterations, double& electronicTemperature) const;
+    void loadBoundaryBonds(const std::vector<int>& indices, std::vector<int>& numbers);
+    void createStates();
+    void createDecomposition(const OpenMM::System& system);
+    void createAccurateState();
+    double computeUnscaledForce(OpenMM::ContextImpl& context, const std::vector<OpenMM::Vec3>& positions, std::vector<OpenMM::Vec3>& forces);
+    void computeStates(long long step, const double* boxVectors);
+    void computeAdaptive(long long step, const double* boxVectors);
+    void addForces(const std::vector<double>& gradient, double weight, std::vector<OpenMM::Vec3>& forces) const;
+    double getStateEnergy(int index) const;
+    void getStateGradient(int index, std::vector<double>& gradient) const;
     const XtbForce& owner;
-    xtb_TEnvironment env;
-    xtb_TCalculator calc;
-    xtb_TResults res;
-    xtb_TMolecule mol;
-    double charge;
-    int multiplicity;
-    bool hasInitializedMolecule;
-    std::vector<int> indices, numbers;
-    std::vector<double> positionVec, forceVec;
+    std::vector<XtbCalculation*> states;
+    std::vector<double> stateWeights, appliedWeights;
+    XtbForce::StateCombination stateCombination;
+    OpenMM::ThreadPool* threads;
+    XtbDomainDecomposition* decomposition;
+    XtbCalculation* accurateState;
+    XtbForce::Method accurateMethod;
+    int checkInterval, blendSteps, blendPosition, quietChecks, cheapEvaluations, accurateEvaluations;
+    double forceThreshold, accurateWeight, cheapTime, accurateTime;
+    bool useAccurateMethod;
+    long long lastAdaptiveStep, lastCheckStep;
+    std::vector<long long> switchSteps;
+    std::string scaleParameter;
+    bool computeScaleDerivative;
+    double appliedScale;
+    bool skippedCalculation;
+    XtbForce::Method method;
+    bool periodic;
+    double reducedAccuracy, baseAccuracy, baseElectronicTemperature;
+    int baseMaxIterations;
+    std::vector<SchedulePhase> schedule;
+    int contextId, fullAccuracyInterval, numSystemParticles;
+    bool cacheValid, snapshotValid;
+    CachedConfiguration cache, snapshot;
+    std::vector<int> indices, numbers, linkQMParticles, linkMMParticles;
+    std::vector<double> positionVec, linkScales;
 };
 
 } // namespace XtbPlugin
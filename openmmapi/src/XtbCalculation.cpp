@@ -0,0 +1,251 @@
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2023 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/XtbCalculation.h"
+#include "XtbTracer.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/internal/ThreadPool.h"
+#include <algorithm>
+#include <cstdlib>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace XtbPlugin;
+using namespace OpenMM;
+using namespace std;
+
+// These are the settings XTB uses when a calculator is created.
+
+static const double defaultAccuracy = 1.0;
+static const int defaultMaxIterations = 250;
+static const double defaultElectronicTemperature = 300.0;
+
+XtbCalculation::XtbCalculation(XtbForce::Method method, double charge, int multiplicity, bool periodic, const vector<int>& numbers) :
+        method(method), charge(charge), energy(0.0), accuracy(defaultAccuracy), appliedAccuracy(defaultAccuracy),
+        electronicTemperature(defaultElectronicTemperature), appliedElectronicTemperature(defaultElectronicTemperature), multiplicity(multiplicity),
+        maxIterations(defaultMaxIterations), appliedMaxIterations(defaultMaxIterations), numThreads(0), periodic(periodic),
+        needParameters(true), wavefunctionValid(false), numbers(numbers), gradient(3*numbers.size(), 0.0), virial(9, 0.0), charges(numbers.size(), 0.0),
+        env(nullptr), calc(nullptr), res(nullptr), snapshotRes(nullptr), mol(nullptr) {
+    env = xtb_newEnvironment();
+    calc = xtb_newCalculator();
+    res = xtb_newResults();
+    xtb_setVerbosity(env, XTB_VERBOSITY_MUTED);
+    checkErrors();
+}
+
+XtbCalculation::~XtbCalculation() {
+    discardSnapshot();
+    if (res != nullptr)
+        xtb_delResults(&res);
+    if (calc != nullptr)
+        xtb_delCalculator(&calc);
+    if (mol != nullptr)
+        xtb_delMolecule(&mol);
+    if (env != nullptr)
+        xtb_delEnvironment(&env);
+}
+
+void XtbCalculation::setAccuracy(double accuracy) {
+    this->accuracy = accuracy;
+}
+
+void XtbCalculation::setSCCParameters(int maxIterations, double electronicTemperature) {
+    this->maxIterations = maxIterations;
+    this->electronicTemperature = electronicTemperature;
+}
+
+void XtbCalculation::setNumThreads(int numThreads) {
+    this->numThreads = numThreads;
+}
+
+void XtbCalculation::selectNumThreads(int numCalculations, int& numWorkers, int& threadsPerCalculation) {
+    int numProcessors = ThreadPool::getNumProcessors();
+    const char* ompThreads = getenv("OMP_NUM_THREADS");
+    int requestedThreads = (ompThreads == nullptr ? 0 : atoi(ompThreads));
+    if (requestedThreads > 0) {
+        threadsPerCalculation = requestedThreads;
+        numWorkers = max(1, min(numCalculations, numProcessors/requestedThreads));
+    }
+    else {
+        numWorkers = max(1, min(numCalculations, numProcessors));
+        threadsPerCalculation = max(1, numProcessors/numWorkers);
+    }
+}
+
+void XtbCalculation::setMethod(XtbForce::Method method) {
+    if (method == this->method)
+        return;
+    this->method = method;
+    needParameters = true;
+    resetResults();
+}
+
+void XtbCalculation::setElectronicState(double charge, int multiplicity) {
+    if (charge == this->charge && multiplicity == this->multiplicity)
+        return;
+    this->charge = charge;
+    this->multiplicity = multiplicity;
+    if (mol != nullptr)
+        xtb_delMolecule(&mol);
+    mol = nullptr;
+
+    // The xTB parameters do not depend on the charge, but the GFN-FF topology does.  A wavefunction
+    // with a different number of electrons is not a useful guess.
+
+    if (method == XtbForce::GFNFF)
+        needParameters = true;
+    resetResults();
+}
+
+void XtbCalculation::saveSnapshot() {
+    discardSnapshot();
+    snapshotRes = xtb_copyResults(res);
+    snapshotEnergy = energy;
+    snapshotGradient = gradient;
+    snapshotVirial = virial;
+    snapshotCharges = charges;
+}
+
+void XtbCalculation::restoreSnapshot() {
+    if (snapshotRes == nullptr)
+        throw OpenMMException("XtbCalculation: no snapshot to restore");
+    xtb_delResults(&res);
+    res = snapshotRes;
+    snapshotRes = nullptr;
+    energy = snapshotEnergy;
+    gradient.swap(snapshotGradient);
+    virial.swap(snapshotVirial);
+    charges.swap(snapshotCharges);
+}
+
+void XtbCalculation::discardSnapshot() {
+    if (snapshotRes != nullptr)
+        xtb_delResults(&snapshotRes);
+    snapshotRes = nullptr;
+}
+
+void XtbCalculation::resetResults() {
+    discardSnapshot();
+    xtb_delResults(&res);
+    res = xtb_newResults();
+    wavefunctionValid = false;
+}
+
+void XtbCalculation::compute(const double* positions, const double* box, int contextId, long long step) {
+#ifdef _OPENMP
+    // The number of threads is a per-thread setting, so it must be set on the thread that calls XTB.
+
+    if (numThreads > 0)
+        omp_set_num_threads(numThreads);
+#endif
+    if (mol != nullptr) {
+        XtbTracer::Phase phase("updateMolecule", contextId, step);
+        xtb_updateMolecule(env, mol, positions, box);
+    }
+    else {
+        XtbTracer::Phase phase("createMolecule", contextId, step);
+        // XTB takes the number of unpaired electrons, not the multiplicity.
+
+        int numAtoms = numbers.size();
+        int unpairedElectrons = multiplicity-1;
+        bool periodicAxes[3] = {periodic, periodic, periodic};
+        mol = xtb_newMolecule(env, &numAtoms, numbers.data(), positions, &charge, &unpairedElectrons, box, periodicAxes);
+        checkErrors();
+    }
+    if (needParameters) {
+        XtbTracer::Phase phase("loadParameters", contextId, step);
+        xtb_delCalculator(&calc);
+        calc = xtb_newCalculator();
+        if (method == XtbForce::GFN1xTB)
+            xtb_loadGFN1xTB(env, mol, calc, NULL);
+        else if (method == XtbForce::GFN2xTB)
+            xtb_loadGFN2xTB(env, mol, calc, NULL);
+        else if (method == XtbForce::GFNFF)
+            xtb_loadGFNFF(env, mol, calc, NULL);
+        checkErrors();
+        appliedAccuracy = defaultAccuracy;
+        appliedMaxIterations = defaultMaxIterations;
+        appliedElectronicTemperature = defaultElectronicTemperature;
+        needParameters = false;
+    }
+    checkErrors();
+
+    // GFNFF does not use an SCC procedure, so these settings only apply to the other methods.
+
+    if (method != XtbForce::GFNFF) {
+        if (accuracy != appliedAccuracy) {
+            xtb_setAccuracy(env, calc, accuracy);
+            checkErrors();
+            appliedAccuracy = accuracy;
+        }
+        if (maxIterations != appliedMaxIterations) {
+            xtb_setMaxIter(env, calc, maxIterations);
+            checkErrors();
+            appliedMaxIterations = maxIterations;
+        }
+        if (electronicTemperature != appliedElectronicTemperature) {
+            xtb_setElectronicTemp(env, calc, electronicTemperature);
+            checkErrors();
+            appliedElectronicTemperature = electronicTemperature;
+        }
+    }
+
+    // Perform the computation.
+
+    {
+        XtbTracer::Phase phase("singlepoint", contextId, step);
+        xtb_singlepoint(env, mol, calc, res);
+        checkErrors();
+        wavefunctionValid = true;
+    }
+    XtbTracer::Phase phase("extractResults", contextId, step);
+    xtb_getEnergy(env, res, &energy);
+    checkErrors();
+    xtb_getGradient(env, res, gradient.data());
+    checkErrors();
+    xtb_getCharges(env, res, charges.data());
+    checkErrors();
+    if (periodic) {
+        xtb_getVirial(env, res, virial.data());
+        checkErrors();
+    }
+}
+
+void XtbCalculation::checkErrors() {
+    if (xtb_checkEnvironment(env)) {
+        vector<char> buffer(1000);
+        int maxLength = buffer.size();
+        xtb_getError(env, buffer.data(), &maxLength);
+        throw OpenMMException(string(buffer.data()));
+    }
+}
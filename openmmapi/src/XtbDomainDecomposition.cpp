@@ -0,0 +1,313 @@
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2023 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/XtbDomainDecomposition.h"
+#include "XtbTracer.h"
+#include "openmm/OpenMMException.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <string>
+
+using namespace XtbPlugin;
+using namespace OpenMM;
+using namespace std;
+
+static const double distanceScale = 18.897261246257703; // Convert nm to bohr
+
+// The skin is a fraction of the buffer width.  Larger values cause the assignment to be updated less
+// often, but make every cell larger.
+
+static const double skinFraction = 0.25;
+
+XtbDomainDecomposition::XtbDomainDecomposition(XtbForce::Method method, int multiplicity, const vector<int>& numbers, double cellSize, double bufferWidth) :
+        method(method), multiplicity(multiplicity), maxIterations(250), threadsPerCell(0), numbers(numbers), cellSize(distanceScale*cellSize),
+        bufferWidth(distanceScale*bufferWidth), skin(skinFraction*distanceScale*bufferWidth), electronicTemperature(300.0), fractional(3*numbers.size()),
+        gradient(3*numbers.size(), 0.0), charges(numbers.size(), 0.0), threads(nullptr) {
+    for (int i = 0; i < 3; i++)
+        numCells[i] = 0;
+    for (int i = 0; i < 9; i++)
+        box[i] = 0.0;
+}
+
+XtbDomainDecomposition::~XtbDomainDecomposition() {
+    deleteCells();
+    if (threads != nullptr)
+        delete threads;
+}
+
+void XtbDomainDecomposition::setSCCParameters(int maxIterations, double electronicTemperature) {
+    this->maxIterations = maxIterations;
+    this->electronicTemperature = electronicTemperature;
+}
+
+void XtbDomainDecomposition::deleteCells() {
+    for (Cell& cell : cells)
+        if (cell.calc != nullptr)
+            delete cell.calc;
+    cells.clear();
+}
+
+/**
+ * Compute the distance between the two planes of the box perpendicular to each axis.
+ */
+static void computeBoxWidths(const double* box, double* widths) {
+    double volume = box[0]*box[4]*box[8];
+    for (int i = 0; i < 3; i++) {
+        const double* u = &box[3*((i+1)%3)];
+        const double* v = &box[3*((i+2)%3)];
+        double cx = u[1]*v[2]-u[2]*v[1];
+        double cy = u[2]*v[0]-u[0]*v[2];
+        double cz = u[0]*v[1]-u[1]*v[0];
+        widths[i] = volume/sqrt(cx*cx+cy*cy+cz*cz);
+    }
+}
+
+bool XtbDomainDecomposition::needsAssignment(const double* box) const {
+    if (cells.empty())
+        return true;
+    for (int i = 0; i < 9; i++)
+        if (box[i] != this->box[i])
+            return true;
+    double maxDisplacement2 = 0.25*skin*skin;
+    for (int i = 0; i < numbers.size(); i++) {
+        double delta[3];
+        for (int j = 0; j < 3; j++) {
+            delta[j] = fractional[3*i+j]-assignedFractional[3*i+j];
+            delta[j] -= round(delta[j]);
+        }
+        double dx = delta[0]*box[0]+delta[1]*box[3]+delta[2]*box[6];
+        double dy = delta[1]*box[4]+delta[2]*box[7];
+        double dz = delta[2]*box[8];
+        if (dx*dx+dy*dy+dz*dz > maxDisplacement2)
+            return true;
+    }
+    return false;
+}
+
+void XtbDomainDecomposition::assignCells(const double* box) {
+    // Record the positions the assignment is based on, wrapped into the box.
+
+    copy(box, box+9, this->box);
+    assignedFractional.resize(fractional.size());
+    for (int i = 0; i < fractional.size(); i++)
+        assignedFractional[i] = fractional[i]-floor(fractional[i]);
+
+    // Decide how many cells to use along each axis.
+
+    double widths[3], buffer[3];
+    int newNumCells[3];
+    computeBoxWidths(box, widths);
+    for (int i = 0; i < 3; i++) {
+        newNumCells[i] = max(1, (int) floor(widths[i]/cellSize));
+        buffer[i] = (bufferWidth+skin)/widths[i];
+    }
+    if (newNumCells[0] != numCells[0] || newNumCells[1] != numCells[1] || newNumCells[2] != numCells[2]) {
+        deleteCells();
+        cells.resize(newNumCells[0]*newNumCells[1]*newNumCells[2]);
+        for (int i = 0; i < newNumCells[0]; i++)
+            for (int j = 0; j < newNumCells[1]; j++)
+                for (int k = 0; k < newNumCells[2]; k++) {
+                    Cell& cell = cells[(i*newNumCells[1]+j)*newNumCells[2]+k];
+                    cell.index[0] = i;
+                    cell.index[1] = j;
+                    cell.index[2] = k;
+                }
+        for (int i = 0; i < 3; i++)
+            numCells[i] = newNumCells[i];
+
+        // Decide how many cells to compute at once, and how many OpenMP threads each one gets.
+
+        int numWorkers;
+        XtbCalculation::selectNumThreads(cells.size(), numWorkers, threadsPerCell);
+        if (threads != nullptr && threads->getNumThreads() != numWorkers) {
+            delete threads;
+            threads = nullptr;
+        }
+        if (threads == nullptr && numWorkers > 1)
+            threads = new ThreadPool(numWorkers);
+    }
+
+    // Find the cells each atom belongs to.  It is an interior atom of the cell containing it, and a
+    // buffer atom of every cell it is within the buffer distance of.  We loop over the cells without
+    // wrapping them into the box, so an atom may be a buffer atom of a cell several times, each time as a
+    // different periodic image.  This happens when a cell spans the whole box along some axis.
+
+    vector<vector<int> > interior(cells.size()), bufferAtoms(cells.size()), bufferImages(cells.size());
+    vector<int> ranges[3], shifts[3];
+    for (int atom = 0; atom < numbers.size(); atom++) {
+        int home[3];
+        for (int i = 0; i < 3; i++) {
+            double f = assignedFractional[3*atom+i];
+            home[i] = min(numCells[i]-1, (int) (f*numCells[i]));
+            ranges[i].clear();
+            shifts[i].clear();
+            int first = (int) floor((f-buffer[i])*numCells[i]);
+            int last = (int) floor((f+buffer[i])*numCells[i]);
+            for (int j = first; j <= last; j++) {
+                int index = ((j%numCells[i])+numCells[i])%numCells[i];
+                ranges[i].push_back(index);
+                shifts[i].push_back((index-j)/numCells[i]);
+            }
+        }
+        for (int i = 0; i < ranges[0].size(); i++)
+            for (int j = 0; j < ranges[1].size(); j++)
+                for (int k = 0; k < ranges[2].size(); k++) {
+                    int cellIndex = (ranges[0][i]*numCells[1]+ranges[1][j])*numCells[2]+ranges[2][k];
+                    bool isHome = (ranges[0][i] == home[0] && ranges[1][j] == home[1] && ranges[2][k] == home[2]);
+                    if (isHome && shifts[0][i] == 0 && shifts[1][j] == 0 && shifts[2][k] == 0)
+                        interior[cellIndex].push_back(atom);
+                    else {
+                        bufferAtoms[cellIndex].push_back(atom);
+                        bufferImages[cellIndex].push_back(shifts[0][i]);
+                        bufferImages[cellIndex].push_back(shifts[1][j]);
+                        bufferImages[cellIndex].push_back(shifts[2][k]);
+                    }
+                }
+    }
+
+    // Rebuild only the cells whose atoms have changed.  The others keep their XTB objects.  An atom moving
+    // to a different periodic image does not require a rebuild.
+
+    for (int i = 0; i < cells.size(); i++) {
+        Cell& cell = cells[i];
+        vector<int> atoms = interior[i];
+        atoms.insert(atoms.end(), bufferAtoms[i].begin(), bufferAtoms[i].end());
+        cell.images.assign(3*interior[i].size(), 0);
+        cell.images.insert(cell.images.end(), bufferImages[i].begin(), bufferImages[i].end());
+        if (atoms == cell.atoms && cell.numInterior == interior[i].size())
+            continue;
+        if (cell.calc != nullptr) {
+            delete cell.calc;
+            cell.calc = nullptr;
+        }
+        cell.atoms = atoms;
+        cell.numInterior = interior[i].size();
+        cell.positions.resize(3*atoms.size());
+        if (cell.numInterior > 0) {
+            vector<int> cellNumbers;
+            for (int atom : atoms)
+                cellNumbers.push_back(numbers[atom]);
+
+            // There is no way to know how the total charge is distributed between cells, so only neutral
+            // systems are supported (see XtbForceImpl::createDecomposition()) and every cell is assumed to
+            // be neutral.
+
+            cell.calc = new XtbCalculation(method, 0.0, multiplicity, false, cellNumbers);
+        }
+    }
+}
+
+void XtbDomainDecomposition::compute(const vector<double>& positions, const double* box, double accuracy, double reducedAccuracy, int contextId, long long step) {
+    // Convert the positions to fractional coordinates.  This assumes the box is in the reduced form
+    // OpenMM always uses.  They are not wrapped into the box, since atoms must stay next to the atoms
+    // they interact with.
+
+    for (int i = 0; i < numbers.size(); i++) {
+        double* f = &fractional[3*i];
+        const double* r = &positions[3*i];
+        f[2] = r[2]/box[8];
+        f[1] = (r[1]-f[2]*box[7])/box[4];
+        f[0] = (r[0]-f[2]*box[6]-f[1]*box[3])/box[0];
+    }
+    if (needsAssignment(box)) {
+        XtbTracer::Phase phase("assignCells", contextId, step);
+        assignCells(box);
+    }
+
+    // Compute the cells in parallel.  They can have very different sizes, so each thread takes the next
+    // available cell rather than using a fixed division.  Exceptions cannot propagate out of the worker
+    // threads, so record any error and rethrow it afterward.
+
+    vector<string> errors(cells.size());
+    atomic<int> nextCell(0);
+    auto computeCells = [&] () {
+        while (true) {
+            int i = nextCell++;
+            if (i >= cells.size())
+                break;
+            Cell& cell = cells[i];
+            if (cell.calc == nullptr)
+                continue;
+
+            // Place each atom at the periodic image it was assigned to the cell as.  Atoms may have crossed
+            // the box boundary since they were assigned, so find the image relative to the position at
+            // assignment time.  Atoms never move more than half a box width between assignments.
+
+            for (int j = 0; j < cell.atoms.size(); j++) {
+                double g[3];
+                for (int k = 0; k < 3; k++) {
+                    int index = 3*cell.atoms[j]+k;
+                    double delta = fractional[index]-assignedFractional[index];
+                    g[k] = assignedFractional[index]+(delta-round(delta))+cell.images[3*j+k];
+                }
+                cell.positions[3*j] = g[0]*box[0]+g[1]*box[3]+g[2]*box[6];
+                cell.positions[3*j+1] = g[1]*box[4]+g[2]*box[7];
+                cell.positions[3*j+2] = g[2]*box[8];
+            }
+            try {
+                cell.calc->setAccuracy(cell.calc->hasWavefunction() ? reducedAccuracy : accuracy);
+                cell.calc->setSCCParameters(maxIterations, electronicTemperature);
+                cell.calc->setNumThreads(threadsPerCell);
+                cell.calc->compute(cell.positions.data(), box, contextId, step);
+            }
+            catch (const exception& e) {
+                errors[i] = e.what();
+            }
+        }
+    };
+    if (threads == nullptr)
+        computeCells();
+    else {
+        threads->execute([&] (ThreadPool& pool, int threadIndex) {
+            computeCells();
+        });
+        threads->waitForThreads();
+    }
+    for (const string& error : errors)
+        if (!error.empty())
+            throw OpenMMException(error);
+
+    // Each atom takes its gradient and charge from the cell it is interior to.
+
+    for (const Cell& cell : cells) {
+        if (cell.calc == nullptr)
+            continue;
+        const vector<double>& cellGradient = cell.calc->getGradient();
+        const vector<double>& cellCharges = cell.calc->getCharges();
+        for (int j = 0; j < cell.numInterior; j++) {
+            for (int k = 0; k < 3; k++)
+                gradient[3*cell.atoms[j]+k] = cellGradient[3*j+k];
+            charges[cell.atoms[j]] = cellCharges[j];
+        }
+    }
+}
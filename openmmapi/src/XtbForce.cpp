@@ -30,6 +30,7 @@
  * -------------------------------------------------------------------------- */
 
 #include "openmm/OpenMMException.h"
+#include "openmm/internal/AssertionUtilities.h"
 #include "XtbForce.h"
 #include "internal/XtbForceImpl.h"
 
@@ -38,7 +39,11 @@ using namespace OpenMM;
 using namespace std;
 
 XtbForce::XtbForce(XtbForce::Method method, double charge, int multiplicity, bool periodic, const vector<int>& particleIndices, const vector<int>& atomicNumbers) :
-        method(method), charge(charge), multiplicity(multiplicity), periodic(periodic), particleIndices(particleIndices), atomicNumbers(atomicNumbers) {
+        method(method), stateCombination(WeightedSum), periodic(periodic), particleIndices(particleIndices), atomicNumbers(atomicNumbers),
+        accuracy(1.0), electronicTemperature(300.0), reducedAccuracy(0.0), maxIterations(250), fullAccuracyInterval(10), useDomainDecomposition(false), cellSize(2.0), bufferWidth(0.8),
+        useAdaptiveMethod(false), accurateMethod(GFN2xTB), checkInterval(10), blendSteps(10), forceThreshold(100.0),
+        scaleParameterDefaultValue(1.0) {
+    states.push_back(ElectronicStateInfo(charge, multiplicity, 1.0));
 }
 
 XtbForce::Method XtbForce::getMethod() const {
@@ -50,19 +55,81 @@ void XtbForce::setMethod(XtbForce::Method method) {
 }
 
 double XtbForce::getCharge() const {
-    return charge;
+    return states[0].charge;
 }
 
 void XtbForce::setCharge(double charge) {
-    this->charge = charge;
+    states[0].charge = charge;
 }
 
 int XtbForce::getMultiplicity() const {
-    return multiplicity;
+    return states[0].multiplicity;
 }
 
 void XtbForce::setMultiplicity(int multiplicity) {
-    this->multiplicity = multiplicity;
+    states[0].multiplicity = multiplicity;
+}
+
+int XtbForce::getNumElectronicStates() const {
+    return states.size();
+}
+
+int XtbForce::addElectronicState(double charge, int multiplicity, double weight) {
+    states.push_back(ElectronicStateInfo(charge, multiplicity, weight));
+    return states.size()-1;
+}
+
+void XtbForce::getElectronicStateParameters(int index, double& charge, int& multiplicity, double& weight) const {
+    ASSERT_VALID_INDEX(index, states);
+    charge = states[index].charge;
+    multiplicity = states[index].multiplicity;
+    weight = states[index].weight;
+}
+
+void XtbForce::setElectronicStateParameters(int index, double charge, int multiplicity, double weight) {
+    ASSERT_VALID_INDEX(index, states);
+    states[index].charge = charge;
+    states[index].multiplicity = multiplicity;
+    states[index].weight = weight;
+}
+
+int XtbForce::getNumBoundaryBonds() const {
+    return boundaryBonds.size();
+}
+
+int XtbForce::addBoundaryBond(int qmParticle, int mmParticle, double scale) {
+    boundaryBonds.push_back(BoundaryBondInfo(qmParticle, mmParticle, scale));
+    return boundaryBonds.size()-1;
+}
+
+void XtbForce::getBoundaryBondParameters(int index, int& qmParticle, int& mmParticle, double& scale) const {
+    ASSERT_VALID_INDEX(index, boundaryBonds);
+    qmParticle = boundaryBonds[index].qmParticle;
+    mmParticle = boundaryBonds[index].mmParticle;
+    scale = boundaryBonds[index].scale;
+}
+
+void XtbForce::setBoundaryBondParameters(int index, int qmParticle, int mmParticle, double scale) {
+    ASSERT_VALID_INDEX(index, boundaryBonds);
+    boundaryBonds[index].qmParticle = qmParticle;
+    boundaryBonds[index].mmParticle = mmParticle;
+    boundaryBonds[index].scale = scale;
+}
+
+XtbForce::StateCombination XtbForce::getStateCombination() const {
+    return stateCombination;
+}
+
+void XtbForce::setStateCombination(XtbForce::StateCombination combination) {
+    stateCombination = combination;
+}
+
+void XtbForce::getElectronicStateEnergiesInContext(const Context& context, vector<double>& energies) const {
+    dynamic_cast<const XtbForceImpl&>(getImplInContext(context)).getStateEnergies(energies);
+}
+
+void XtbForce::getElectronicStateForcesInContext(const Context& context, int index, vector<Vec3>& forces) const {
+    dynamic_cast<const XtbForceImpl&>(getImplInContext(context)).getStateForces(index, forces);
 }
 
 const vector<int>& XtbForce::getParticleIndices() const {
@@ -89,6 +156,188 @@ void XtbForce::setUsesPeriodicBoundaryConditions(bool periodic) {
     this->periodic = periodic;
 }
 
+static void checkSCCParameters(double accuracy, int maxIterations, double electronicTemperature) {
+    if (accuracy <= 0)
+        throw OpenMMException("XtbForce: the accuracy must be positive");
+    if (maxIterations < 1)
+        throw OpenMMException("XtbForce: the maximum number of iterations must be at least 1");
+    if (electronicTemperature < 0)
+        throw OpenMMException("XtbForce: the electronic temperature cannot be negative");
+}
+
+double XtbForce::getAccuracy() const {
+    return accuracy;
+}
+
+void XtbForce::setAccuracy(double accuracy) {
+    checkSCCParameters(accuracy, maxIterations, electronicTemperature);
+    this->accuracy = accuracy;
+}
+
+int XtbForce::getMaxIterations() const {
+    return maxIterations;
+}
+
+void XtbForce::setMaxIterations(int iterations) {
+    checkSCCParameters(accuracy, iterations, electronicTemperature);
+    maxIterations = iterations;
+}
+
+double XtbForce::getElectronicTemperature() const {
+    return electronicTemperature;
+}
+
+void XtbForce::setElectronicTemperature(double temperature) {
+    checkSCCParameters(accuracy, maxIterations, temperature);
+    electronicTemperature = temperature;
+}
+
+int XtbForce::getNumSchedulePhases() const {
+    return schedule.size();
+}
+
+int XtbForce::addSchedulePhase(long long startStep, double accuracy, int maxIterations, double electronicTemperature) {
+    checkSCCParameters(accuracy, maxIterations, electronicTemperature);
+    schedule.push_back(SchedulePhaseInfo(startStep, accuracy, maxIterations, electronicTemperature));
+    return schedule.size()-1;
+}
+
+void XtbForce::getSchedulePhaseParameters(int index, long long& startStep, double& accuracy, int& maxIterations, double& electronicTemperature) const {
+    ASSERT_VALID_INDEX(index, schedule);
+    startStep = schedule[index].startStep;
+    accuracy = schedule[index].accuracy;
+    maxIterations = schedule[index].maxIterations;
+    electronicTemperature = schedule[index].electronicTemperature;
+}
+
+void XtbForce::setSchedulePhaseParameters(int index, long long startStep, double accuracy, int maxIterations, double electronicTemperature) {
+    ASSERT_VALID_INDEX(index, schedule);
+    checkSCCParameters(accuracy, maxIterations, electronicTemperature);
+    schedule[index] = SchedulePhaseInfo(startStep, accuracy, maxIterations, electronicTemperature);
+}
+
+double XtbForce::getReducedAccuracy() const {
+    return reducedAccuracy;
+}
+
+void XtbForce::setReducedAccuracy(double accuracy) {
+    if (accuracy < 0)
+        throw OpenMMException("XtbForce: the reduced accuracy cannot be negative");
+    reducedAccuracy = accuracy;
+}
+
+int XtbForce::getFullAccuracyInterval() const {
+    return fullAccuracyInterval;
+}
+
+void XtbForce::setFullAccuracyInterval(int interval) {
+    if (interval < 1)
+        throw OpenMMException("XtbForce: the full accuracy interval must be at least 1");
+    fullAccuracyInterval = interval;
+}
+
+bool XtbForce::getUsesDomainDecomposition() const {
+    return useDomainDecomposition;
+}
+
+void XtbForce::setUsesDomainDecomposition(bool use) {
+    useDomainDecomposition = use;
+}
+
+void XtbForce::getDomainDecompositionParameters(double& cellSize, double& bufferWidth) const {
+    cellSize = this->cellSize;
+    bufferWidth = this->bufferWidth;
+}
+
+void XtbForce::setDomainDecompositionParameters(double cellSize, double bufferWidth) {
+    if (cellSize <= 0)
+        throw OpenMMException("XtbForce: the cell size must be positive");
+    if (bufferWidth < 0)
+        throw OpenMMException("XtbForce: the buffer width cannot be negative");
+    this->cellSize = cellSize;
+    this->bufferWidth = bufferWidth;
+}
+
+bool XtbForce::getUsesAdaptiveMethod() const {
+    return useAdaptiveMethod;
+}
+
+void XtbForce::setUsesAdaptiveMethod(bool use) {
+    useAdaptiveMethod = use;
+}
+
+void XtbForce::getAdaptiveMethodParameters(Method& accurateMethod, int& checkInterval, double& forceThreshold, int& blendSteps) const {
+    accurateMethod = this->accurateMethod;
+    checkInterval = this->checkInterval;
+    forceThreshold = this->forceThreshold;
+    blendSteps = this->blendSteps;
+}
+
+void XtbForce::setAdaptiveMethodParameters(Method accurateMethod, int checkInterval, double forceThreshold, int blendSteps) {
+    if (checkInterval < 1)
+        throw OpenMMException("XtbForce: the check interval must be at least 1");
+    if (forceThreshold < 0)
+        throw OpenMMException("XtbForce: the force threshold cannot be negative");
+    if (blendSteps < 0)
+        throw OpenMMException("XtbForce: the number of blend steps cannot be negative");
+    this->accurateMethod = accurateMethod;
+    this->checkInterval = checkInterval;
+    this->forceThreshold = forceThreshold;
+    this->blendSteps = blendSteps;
+}
+
+const string& XtbForce::getScaleParameter() const {
+    return scaleParameter;
+}
+
+void XtbForce::setScaleParameter(const string& name) {
+    scaleParameter = name;
+}
+
+double XtbForce::getScaleParameterDefaultValue() const {
+    return scaleParameterDefaultValue;
+}
+
+void XtbForce::setScaleParameterDefaultValue(double value) {
+    scaleParameterDefaultValue = value;
+}
+
+void XtbForce::addEnergyParameterDerivative(const string& name) {
+    if (name.empty() || name != scaleParameter)
+        throw OpenMMException("addEnergyParameterDerivative: Unknown global parameter '"+name+"'");
+    energyParameterDerivatives.push_back(name);
+}
+
+int XtbForce::getNumEnergyParameterDerivatives() const {
+    return energyParameterDerivatives.size();
+}
+
+const string& XtbForce::getEnergyParameterDerivativeName(int index) const {
+    ASSERT_VALID_INDEX(index, energyParameterDerivatives);
+    return energyParameterDerivatives[index];
+}
+
+void XtbForce::getVirialInContext(const Context& context, vector<double>& virial) const {
+    dynamic_cast<const XtbForceImpl&>(getImplInContext(context)).getVirial(virial);
+}
+
+void XtbForce::getAdaptiveMethodStatisticsInContext(const Context& context, int& cheapEvaluations, int& accurateEvaluations,
+                                                    double& cheapTime, double& accurateTime) const {
+    dynamic_cast<const XtbForceImpl&>(getImplInContext(context)).getAdaptiveStatistics(cheapEvaluations, accurateEvaluations, cheapTime, accurateTime);
+}
+
+void XtbForce::getAdaptiveMethodSwitchesInContext(const Context& context, vector<long long>& steps) const {
+    dynamic_cast<const XtbForceImpl&>(getImplInContext(context)).getAdaptiveSwitches(steps);
+}
+
+void XtbForce::getChargesInContext(const Context& context, vector<double>& charges) const {
+    dynamic_cast<const XtbForceImpl&>(getImplInContext(context)).getCharges(charges);
+}
+
+void XtbForce::updateParametersInContext(Context& context) {
+    dynamic_cast<XtbForceImpl&>(getImplInContext(context)).updateParametersInContext(getContextImpl(context));
+}
+
 ForceImpl* XtbForce::createImpl() const {
     return new XtbForceImpl(*this);
 }
@@ -30,25 +30,56 @@
  * -------------------------------------------------------------------------- */
 
 #include "internal/XtbForceImpl.h"
+#include "XtbTracer.h"
+#include "openmm/MonteCarloAnisotropicBarostat.h"
+#include "openmm/MonteCarloBarostat.h"
+#include "openmm/MonteCarloFlexibleBarostat.h"
+#include "openmm/MonteCarloMembraneBarostat.h"
 #include "openmm/OpenMMException.h"
 #include "openmm/internal/ContextImpl.h"
+#include "openmm/reference/ReferencePlatform.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <set>
 
 using namespace XtbPlugin;
 using namespace OpenMM;
 using namespace std;
 
-XtbForceImpl::XtbForceImpl(const XtbForce& owner) : CustomCPPForceImpl(owner), owner(owner), env(nullptr), calc(nullptr), res(nullptr), mol(nullptr), hasInitializedMolecule(false) {
+static const double distanceScale = 18.897261246257703; // Convert nm to bohr
+static const double energyScale = 2625.4996394798254; // Convert Hartree to kJ/mol
+static const double forceScale = 49614.75258920568; // Convert Hartree/bohr to kJ/mol/nm
+
+// The adaptive method switches back to the cheap method after this many consecutive checks with a small error.
+
+static const int requiredQuietChecks = 3;
+
+XtbForceImpl::XtbForceImpl(const XtbForce& owner) : CustomCPPForceImpl(owner), owner(owner), threads(nullptr), decomposition(nullptr), accurateState(nullptr),
+        blendPosition(0), quietChecks(0), cheapEvaluations(0), accurateEvaluations(0), accurateWeight(0.0), cheapTime(0.0), accurateTime(0.0),
+        useAccurateMethod(false), lastAdaptiveStep(-1), lastCheckStep(-1), appliedScale(1.0), skippedCalculation(false), cacheValid(false), snapshotValid(false) {
+}
+
+bool XtbForceImpl::CachedConfiguration::matchesBox(const double* box) const {
+    for (int i = 0; i < 9; i++)
+        if (this->box[i] != box[i])
+            return false;
+    return true;
+}
+
+bool XtbForceImpl::CachedConfiguration::matches(const vector<double>& positions, const double* box, bool needFullAccuracy, int schedulePhase) const {
+    return (fullAccuracy || !needFullAccuracy) && this->schedulePhase == schedulePhase && matchesBox(box) && this->positions == positions;
 }
 
 XtbForceImpl::~XtbForceImpl() {
-    if (res != nullptr)
-        xtb_delResults(&res);
-    if (calc != nullptr)
-        xtb_delCalculator(&calc);
-    if (mol != nullptr)
-        xtb_delMolecule(&mol);
-    if (env != nullptr)
-        xtb_delEnvironment(&env);
+    for (XtbCalculation* state : states)
+        delete state;
+    if (threads != nullptr)
+        delete threads;
+    if (decomposition != nullptr)
+        delete decomposition;
+    if (accurateState != nullptr)
+        delete accurateState;
 }
 
 void XtbForceImpl::initialize(ContextImpl& context) {
@@ -57,73 +88,627 @@ void XtbForceImpl::initialize(ContextImpl& context) {
     numbers = owner.getAtomicNumbers();
     if (indices.size() != numbers.size())
         throw OpenMMException("Different numbers of particle indices and atomic numbers are specified");
-    charge = owner.getCharge();
-    multiplicity = owner.getMultiplicity();
-    env = xtb_newEnvironment();
-    calc = xtb_newCalculator();
-    res = xtb_newResults();
-    xtb_setVerbosity(env, XTB_VERBOSITY_MUTED);
-    checkErrors();
-    int numParticles = indices.size();
-    positionVec.resize(3*numParticles, 0.0);
-    forceVec.resize(3*numParticles);
-  }
+    numSystemParticles = context.getSystem().getNumParticles();
+    loadBoundaryBonds(indices, numbers);
+    method = owner.getMethod();
+    periodic = owner.usesPeriodicBoundaryConditions();
+    reducedAccuracy = owner.getReducedAccuracy();
+    loadSchedule();
+    fullAccuracyInterval = owner.getFullAccuracyInterval();
+    stateCombination = owner.getStateCombination();
+    contextId = XtbTracer::createContextId();
+    scaleParameter = owner.getScaleParameter();
+    for (int i = 0; i < owner.getNumEnergyParameterDerivatives(); i++)
+        if (owner.getEnergyParameterDerivativeName(i) != scaleParameter)
+            throw OpenMMException("XtbForce: Unknown global parameter '"+owner.getEnergyParameterDerivativeName(i)+"' for energy parameter derivative");
+    computeScaleDerivative = (owner.getNumEnergyParameterDerivatives() > 0);
+    if (computeScaleDerivative) {
+        // The derivative is added to the platform data of the Reference platform, which the CPU platform
+        // also uses.  Other platforms would silently drop it.
+
+        const string& platformName = context.getPlatform().getName();
+        if (platformName != "Reference" && platformName != "CPU")
+            throw OpenMMException("XtbForce: Energy parameter derivatives are only supported on the Reference and CPU platforms, not "+platformName);
+    }
+    if (owner.getUsesDomainDecomposition())
+        createDecomposition(context.getSystem());
+    else
+        createStates();
+    if (owner.getUsesAdaptiveMethod())
+        createAccurateState();
+    positionVec.resize(3*numbers.size(), 0.0);
+}
+
+void XtbForceImpl::loadSchedule() {
+    baseAccuracy = owner.getAccuracy();
+    baseMaxIterations = owner.getMaxIterations();
+    baseElectronicTemperature = owner.getElectronicTemperature();
+    schedule.resize(owner.getNumSchedulePhases());
+    for (int i = 0; i < schedule.size(); i++) {
+        SchedulePhase& phase = schedule[i];
+        owner.getSchedulePhaseParameters(i, phase.startStep, phase.accuracy, phase.maxIterations, phase.electronicTemperature);
+    }
+    stable_sort(schedule.begin(), schedule.end(), [] (const SchedulePhase& a, const SchedulePhase& b) {
+        return a.startStep < b.startStep;
+    });
+}
+
+int XtbForceImpl::selectSCCParameters(long long step, double& accuracy, int& maxIterations, double& electronicTemperature) const {
+    accuracy = baseAccuracy;
+    maxIterations = baseMaxIterations;
+    electronicTemperature = baseElectronicTemperature;
+    int current = -1;
+    for (int i = 0; i < schedule.size() && schedule[i].startStep <= step; i++) {
+        accuracy = schedule[i].accuracy;
+        maxIterations = schedule[i].maxIterations;
+        electronicTemperature = schedule[i].electronicTemperature;
+        current = i;
+    }
+    return current;
+}
+
+void XtbForceImpl::createStates() {
+    int numStates = owner.getNumElectronicStates();
+    while (states.size() > numStates) {
+        delete states.back();
+        states.pop_back();
+    }
+    stateWeights.resize(numStates);
+    for (int i = 0; i < numStates; i++) {
+        double charge, weight;
+        int multiplicity;
+        owner.getElectronicStateParameters(i, charge, multiplicity, weight);
+        if (i < states.size()) {
+            states[i]->setMethod(method);
+            states[i]->setElectronicState(charge, multiplicity);
+        }
+        else
+            states.push_back(new XtbCalculation(method, charge, multiplicity, periodic, numbers));
+        stateWeights[i] = weight;
+    }
+
+    // Decide how many states to compute at once, and how many OpenMP threads each one gets, so together
+    // they do not use more threads than there are processors.
+
+    int numWorkers = 1, threadsPerState = 0;
+    if (numStates > 1)
+        XtbCalculation::selectNumThreads(numStates, numWorkers, threadsPerState);
+    for (XtbCalculation* state : states)
+        state->setNumThreads(threadsPerState);
+    if (threads != nullptr && threads->getNumThreads() != numWorkers) {
+        delete threads;
+        threads = nullptr;
+    }
+    if (threads == nullptr && numWorkers > 1)
+        threads = new ThreadPool(numWorkers);
+}
+
+void XtbForceImpl::loadBoundaryBonds(const vector<int>& indices, vector<int>& numbers) {
+    // Each boundary bond adds a hydrogen link atom to the end of the XTB molecule.
+
+    int numBonds = owner.getNumBoundaryBonds();
+    vector<int> qmParticles(numBonds), mmParticles(numBonds);
+    vector<double> scales(numBonds);
+    set<int> qmSet(indices.begin(), indices.end());
+    for (int i = 0; i < numBonds; i++) {
+        owner.getBoundaryBondParameters(i, qmParticles[i], mmParticles[i], scales[i]);
+        if (qmSet.find(qmParticles[i]) == qmSet.end())
+            throw OpenMMException("XtbForce: The QM particle of a boundary bond must be one of the particles the force is applied to");
+        if (mmParticles[i] < 0 || mmParticles[i] >= numSystemParticles || qmSet.find(mmParticles[i]) != qmSet.end())
+            throw OpenMMException("XtbForce: The MM particle of a boundary bond must be a particle the force is not applied to");
+    }
+    linkQMParticles = qmParticles;
+    linkMMParticles = mmParticles;
+    linkScales = scales;
+    numbers.resize(numbers.size()+numBonds, 1);
+}
+
+void XtbForceImpl::createDecomposition(const System& system) {
+    if (!periodic)
+        throw OpenMMException("XtbForce: Domain decomposition requires periodic boundary conditions");
+    if (method != XtbForce::GFNFF)
+        throw OpenMMException("XtbForce: Domain decomposition can only be used with GFNFF");
+    if (owner.getNumElectronicStates() != 1)
+        throw OpenMMException("XtbForce: Domain decomposition cannot be used with multiple electronic states");
+    if (owner.getCharge() != 0.0)
+        throw OpenMMException("XtbForce: Domain decomposition requires a total charge of 0");
+    if (owner.getNumBoundaryBonds() > 0)
+        throw OpenMMException("XtbForce: Domain decomposition cannot be used with boundary bonds");
+
+    // Domain decomposition does not compute the energy, so anything that depends on it cannot be used.
+
+    if (owner.getNumEnergyParameterDerivatives() > 0)
+        throw OpenMMException("XtbForce: Domain decomposition cannot be used when computing energy parameter derivatives");
+    for (int i = 0; i < system.getNumForces(); i++) {
+        const Force& force = system.getForce(i);
+        if (dynamic_cast<const MonteCarloBarostat*>(&force) != nullptr || dynamic_cast<const MonteCarloAnisotropicBarostat*>(&force) != nullptr ||
+                dynamic_cast<const MonteCarloMembraneBarostat*>(&force) != nullptr || dynamic_cast<const MonteCarloFlexibleBarostat*>(&force) != nullptr)
+            throw OpenMMException("XtbForce: Domain decomposition cannot be used with a Monte Carlo barostat");
+    }
+    double cellSize, bufferWidth;
+    owner.getDomainDecompositionParameters(cellSize, bufferWidth);
+    if (decomposition != nullptr)
+        delete decomposition;
+    decomposition = new XtbDomainDecomposition(method, owner.getMultiplicity(), numbers, cellSize, bufferWidth);
+}
+
+void XtbForceImpl::createAccurateState() {
+    if (owner.getUsesDomainDecomposition())
+        throw OpenMMException("XtbForce: The adaptive method cannot be combined with domain decomposition");
+    if (owner.getNumElectronicStates() != 1)
+        throw OpenMMException("XtbForce: The adaptive method cannot be used with multiple electronic states");
+    owner.getAdaptiveMethodParameters(accurateMethod, checkInterval, forceThreshold, blendSteps);
+    if (accurateState == nullptr)
+        accurateState = new XtbCalculation(accurateMethod, owner.getCharge(), owner.getMultiplicity(), periodic, numbers);
+    else {
+        accurateState->setMethod(accurateMethod);
+        accurateState->setElectronicState(owner.getCharge(), owner.getMultiplicity());
+    }
+    blendPosition = min(blendPosition, max(blendSteps, 1));
+    accurateWeight = blendPosition/(double) max(blendSteps, 1);
+}
+
+map<string, double> XtbForceImpl::getDefaultParameters() {
+    map<string, double> parameters;
+    if (!owner.getScaleParameter().empty())
+        parameters[owner.getScaleParameter()] = owner.getScaleParameterDefaultValue();
+    return parameters;
+}
+
+void XtbForceImpl::updateParametersInContext(ContextImpl& context) {
+    if (owner.getScaleParameter() != scaleParameter || (owner.getNumEnergyParameterDerivatives() > 0) != computeScaleDerivative)
+        throw OpenMMException("updateParametersInContext: The scale parameter and energy parameter derivatives cannot be changed");
+    const vector<int>& newIndices = owner.getParticleIndices();
+    vector<int> newNumbers = owner.getAtomicNumbers();
+    if (newIndices.size() != newNumbers.size())
+        throw OpenMMException("updateParametersInContext: Different numbers of particle indices and atomic numbers are specified");
+    for (int index : newIndices)
+        if (index < 0 || index >= numSystemParticles)
+            throw OpenMMException("updateParametersInContext: Illegal particle index");
+    loadBoundaryBonds(newIndices, newNumbers);
+
+    // If the atoms (including link atoms) or boundary conditions have changed, every state needs to be
+    // rebuilt from scratch.
+    // Otherwise createStates() only updates the states whose method, charge, or multiplicity changed.
+
+    if (newNumbers != numbers || owner.usesPeriodicBoundaryConditions() != periodic) {
+        for (XtbCalculation* state : states)
+            delete state;
+        states.clear();
+        if (accurateState != nullptr) {
+            delete accurateState;
+            accurateState = nullptr;
+        }
+    }
+    indices = newIndices;
+    numbers = newNumbers;
+    method = owner.getMethod();
+    periodic = owner.usesPeriodicBoundaryConditions();
+    reducedAccuracy = owner.getReducedAccuracy();
+    fullAccuracyInterval = owner.getFullAccuracyInterval();
+    stateCombination = owner.getStateCombination();
+    if (owner.getUsesDomainDecomposition()) {
+        for (XtbCalculation* state : states)
+            delete state;
+        states.clear();
+        createDecomposition(context.getSystem());
+    }
+    else {
+        if (decomposition != nullptr) {
+            delete decomposition;
+            decomposition = nullptr;
+        }
+        createStates();
+    }
+    if (owner.getUsesAdaptiveMethod())
+        createAccurateState();
+    else if (accurateState != nullptr) {
+        delete accurateState;
+        accurateState = nullptr;
+        blendPosition = 0;
+        quietChecks = 0;
+        cheapEvaluations = 0;
+        accurateEvaluations = 0;
+        accurateWeight = 0.0;
+        cheapTime = 0.0;
+        accurateTime = 0.0;
+        useAccurateMethod = false;
+        switchSteps.clear();
+    }
+    positionVec.resize(3*numbers.size(), 0.0);
+
+    // Load the new SCC settings and apply the ones for the current step to every calculation.
+
+    loadSchedule();
+    double accuracy, electronicTemperature;
+    int maxIterations;
+    selectSCCParameters(context.getStepCount(), accuracy, maxIterations, electronicTemperature);
+    for (XtbCalculation* state : states) {
+        state->setAccuracy(accuracy);
+        state->setSCCParameters(maxIterations, electronicTemperature);
+    }
+    if (accurateState != nullptr) {
+        accurateState->setAccuracy(accuracy);
+        accurateState->setSCCParameters(maxIterations, electronicTemperature);
+    }
+    if (decomposition != nullptr)
+        decomposition->setSCCParameters(maxIterations, electronicTemperature);
+    for (XtbCalculation* state : states)
+        state->discardSnapshot();
+    cacheValid = false;
+    snapshotValid = false;
+    context.systemChanged();
+}
+
+double XtbForceImpl::calcForcesAndEnergy(ContextImpl& context, bool includeForces, bool includeEnergy, int groups) {
+    // Domain decomposition does not compute the energy, so report an error rather than returning a wrong value.
+
+    if (includeEnergy && decomposition != nullptr && (groups&(1<<owner.getForceGroup())) != 0)
+        throw OpenMMException("XtbForce: The energy cannot be computed when domain decomposition is used");
+    return CustomCPPForceImpl::calcForcesAndEnergy(context, includeForces, includeEnergy, groups);
+}
 
 double XtbForceImpl::computeForce(ContextImpl& context, const vector<Vec3>& positions, vector<Vec3>& forces) {
-    const double distanceScale = 18.897261246257703; // Convert nm to bohr
-    const double energyScale = 2625.4996394798254; // Convert Hartree to kJ/mol
-    const double forceScale = 49614.75258920568; // Convert Hartree/bohr to kJ/mol/nm
+    // When the scale parameter is 0 and its derivative is not needed, the result is known without calling XTB.
 
+    double scale = (scaleParameter.empty() ? 1.0 : context.getParameter(scaleParameter));
+    appliedScale = scale;
+    skippedCalculation = (scale == 0.0 && !computeScaleDerivative);
+    if (skippedCalculation) {
+        for (int i = 0; i < forces.size(); i++)
+            forces[i] = Vec3();
+        return 0.0;
+    }
+    double energy = computeUnscaledForce(context, positions, forces);
+    if (scale != 1.0)
+        for (int i = 0; i < forces.size(); i++)
+            forces[i] *= scale;
+
+    // The derivative with respect to the scale parameter is the unscaled energy.  Add it to the derivatives
+    // the Reference platform collects from the other forces.
+
+    if (computeScaleDerivative) {
+        ReferencePlatform::PlatformData* data = reinterpret_cast<ReferencePlatform::PlatformData*>(context.getPlatformData());
+        (*data->energyParameterDerivatives)[scaleParameter] += energy;
+    }
+    return scale*energy;
+}
+
+double XtbForceImpl::computeUnscaledForce(ContextImpl& context, const vector<Vec3>& positions, vector<Vec3>& forces) {
     // Pass the current state to XTB.
 
+    long long step = context.getStepCount();
     int numParticles = indices.size();
-    for (int i = 0; i < numParticles; i++) {
-        positionVec[3*i] = distanceScale*positions[indices[i]][0];
-        positionVec[3*i+1] = distanceScale*positions[indices[i]][1];
-        positionVec[3*i+2] = distanceScale*positions[indices[i]][2];
-    }
-    Vec3 box[3];
-    context.getPeriodicBoxVectors(box[0], box[1], box[2]);
     double boxVectors[9];
-    for (int i = 0; i < 3; i++)
-        for (int j = 0; j < 3; j++)
-            boxVectors[3*i+j] = distanceScale*box[i][j];
-    if (hasInitializedMolecule)
-        xtb_updateMolecule(env, mol, positionVec.data(), boxVectors);
+    {
+        XtbTracer::Phase phase("gatherPositions", contextId, step);
+        Vec3 box[3];
+        context.getPeriodicBoxVectors(box[0], box[1], box[2]);
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                boxVectors[3*i+j] = distanceScale*box[i][j];
+        for (int i = 0; i < numParticles; i++) {
+            positionVec[3*i] = distanceScale*positions[indices[i]][0];
+            positionVec[3*i+1] = distanceScale*positions[indices[i]][1];
+            positionVec[3*i+2] = distanceScale*positions[indices[i]][2];
+        }
+
+        // Place a link atom along each boundary bond.
+
+        for (int i = 0; i < linkQMParticles.size(); i++) {
+            Vec3 qmPos = positions[linkQMParticles[i]];
+            Vec3 delta = positions[linkMMParticles[i]]-qmPos;
+            if (periodic) {
+                delta -= box[2]*round(delta[2]/box[2][2]);
+                delta -= box[1]*round(delta[1]/box[1][1]);
+                delta -= box[0]*round(delta[0]/box[0][0]);
+            }
+            Vec3 linkPos = qmPos+delta*linkScales[i];
+            for (int j = 0; j < 3; j++)
+                positionVec[3*(numParticles+i)+j] = distanceScale*linkPos[j];
+        }
+    }
+
+    // If nothing has changed since the last evaluation, reuse its results.  This happens, for example,
+    // when a barostat computes the energy for a trial move and then the integrator computes forces for
+    // the accepted configuration.  A trial move changes the box, so before computing it we save the
+    // current results.  If the move is rejected, the next evaluation is back at the saved configuration
+    // and we restore them instead of recomputing.  Snapshots are not used with domain decomposition,
+    // since the cells may be reassigned when the box changes, or with the adaptive method, since the set
+    // of methods computed changes from step to step.
+
+    double accuracy, electronicTemperature;
+    int maxIterations;
+    int schedulePhase = selectSCCParameters(step, accuracy, maxIterations, electronicTemperature);
+    bool fullAccuracy = (reducedAccuracy == 0 || step%fullAccuracyInterval == 0);
+    if (cacheValid && cache.matches(positionVec, boxVectors, fullAccuracy, schedulePhase)) {
+        // The results from the last evaluation are still valid.
+    }
+    else if (snapshotValid && snapshot.matches(positionVec, boxVectors, fullAccuracy, schedulePhase)) {
+        for (XtbCalculation* state : states)
+            state->restoreSnapshot();
+        cache = snapshot;
+        snapshotValid = false;
+    }
     else {
-        bool periodic[3] = {owner.usesPeriodicBoundaryConditions(), owner.usesPeriodicBoundaryConditions(), owner.usesPeriodicBoundaryConditions()};
-        mol = xtb_newMolecule(env, &numParticles, numbers.data(), positionVec.data(), &charge, &multiplicity, boxVectors, periodic);
-        checkErrors();
-        if (owner.getMethod() == XtbForce::GFN1xTB)
-            xtb_loadGFN1xTB(env, mol, calc, NULL);
-        else if (owner.getMethod() == XtbForce::GFN2xTB)
-            xtb_loadGFN2xTB(env, mol, calc, NULL);
-        else if (owner.getMethod() == XtbForce::GFNFF)
-            xtb_loadGFNFF(env, mol, calc, NULL);
-        checkErrors();
-    }
-    checkErrors();
-
-    // Perform the computation.
-
-    xtb_singlepoint(env, mol, calc, res);
-    checkErrors();
-    double energy;
-    xtb_getEnergy(env, res, &energy);
-    checkErrors();
-    xtb_getGradient(env, res, forceVec.data());
+        if (cacheValid && !cache.matchesBox(boxVectors) && decomposition == nullptr && accurateState == nullptr) {
+            for (XtbCalculation* state : states)
+                state->saveSnapshot();
+            snapshot = cache;
+            snapshotValid = true;
+        }
+        else if (snapshotValid) {
+            for (XtbCalculation* state : states)
+                state->discardSnapshot();
+            snapshotValid = false;
+        }
+
+        // Apply the SCC settings selected by the schedule.  If a reduced accuracy has been set, it is used
+        // between full accuracy steps by calculations that start from a previous wavefunction.
+
+        double stepAccuracy = (fullAccuracy ? accuracy : max(accuracy, reducedAccuracy));
+        auto configure = [&] (XtbCalculation* calc) {
+            calc->setAccuracy(calc->hasWavefunction() ? stepAccuracy : accuracy);
+            calc->setSCCParameters(maxIterations, electronicTemperature);
+        };
+        for (XtbCalculation* state : states)
+            configure(state);
+        if (accurateState != nullptr)
+            configure(accurateState);
+        if (decomposition != nullptr)
+            decomposition->setSCCParameters(maxIterations, electronicTemperature);
+
+        // Perform the computation.
+
+        cacheValid = false;
+        if (decomposition != nullptr)
+            decomposition->compute(positionVec, boxVectors, accuracy, stepAccuracy, contextId, step);
+        else if (accurateState != nullptr)
+            computeAdaptive(step, boxVectors);
+        else
+            computeStates(step, boxVectors);
+        cache.positions = positionVec;
+        copy(boxVectors, boxVectors+9, cache.box);
+        cache.fullAccuracy = fullAccuracy;
+        cache.schedulePhase = schedulePhase;
+        cacheValid = true;
+    }
+
+    // Combine the results from the electronic states.
+
+    XtbTracer::Phase phase("scatterForces", contextId, step);
     for (int i = 0; i < positions.size(); i++)
         forces[i] = Vec3();
-    for (int i = 0; i < numParticles; i++)
-        forces[indices[i]] = -forceScale*Vec3(forceVec[3*i], forceVec[3*i+1], forceVec[3*i+2]);
+    if (decomposition != nullptr) {
+        // The energy is never requested in this case (see calcForcesAndEnergy()).
+
+        addForces(decomposition->getGradient(), 1.0, forces);
+        return 0.0;
+    }
+    appliedWeights.assign(states.size(), 0.0);
+    if (stateCombination == XtbForce::WeightedSum)
+        appliedWeights = stateWeights;
+    else {
+        int lowest = 0;
+        for (int i = 1; i < states.size(); i++)
+            if (states[i]->getEnergy() < states[lowest]->getEnergy())
+                lowest = i;
+        appliedWeights[lowest] = 1.0;
+    }
+    for (double& weight : appliedWeights)
+        weight *= 1.0-accurateWeight;
+    const vector<double>& weights = appliedWeights;
+    double energy = 0.0;
+    for (int i = 0; i < states.size(); i++) {
+        if (weights[i] == 0.0)
+            continue;
+        energy += weights[i]*states[i]->getEnergy();
+        addForces(states[i]->getGradient(), weights[i], forces);
+    }
+    if (accurateWeight > 0.0) {
+        energy += accurateWeight*accurateState->getEnergy();
+        addForces(accurateState->getGradient(), accurateWeight, forces);
+    }
     return energyScale*energy;
 }
 
-void XtbForceImpl::checkErrors() {
-    if (xtb_checkEnvironment(env)) {
-        vector<char> buffer(1000);
-        int maxLength = buffer.size();
-        xtb_getError(env, buffer.data(), &maxLength);
-        throw OpenMMException(string(buffer.data()));
+void XtbForceImpl::addForces(const vector<double>& gradient, double weight, vector<Vec3>& forces) const {
+    int numParticles = indices.size();
+    for (int i = 0; i < numParticles; i++)
+        forces[indices[i]] -= (weight*forceScale)*Vec3(gradient[3*i], gradient[3*i+1], gradient[3*i+2]);
+
+    // The force on each link atom is distributed between the two atoms that define its position.
+
+    for (int i = 0; i < linkQMParticles.size(); i++) {
+        int j = numParticles+i;
+        Vec3 linkForce = -(weight*forceScale)*Vec3(gradient[3*j], gradient[3*j+1], gradient[3*j+2]);
+        forces[linkQMParticles[i]] += linkForce*(1.0-linkScales[i]);
+        forces[linkMMParticles[i]] += linkForce*linkScales[i];
+    }
+}
+
+void XtbForceImpl::computeStates(long long step, const double* boxVectors) {
+    if (threads == nullptr) {
+        for (XtbCalculation* state : states)
+            state->compute(positionVec.data(), boxVectors, contextId, step);
+        return;
     }
-}
\ No newline at end of file
+
+    // Compute the electronic states in parallel.  This relies on XTB keeping all the state of a
+    // calculation in its environment, molecule, calculator, and results objects, so calculations that
+    // share none of them can run on different threads at once (see XtbCalculation).  Exceptions cannot
+    // propagate out of the worker threads, so record any error and rethrow it afterward.
+
+    vector<string> errors(states.size());
+    threads->execute([&] (ThreadPool& pool, int threadIndex) {
+        for (int i = threadIndex; i < states.size(); i += pool.getNumThreads()) {
+            try {
+                states[i]->compute(positionVec.data(), boxVectors, contextId, step);
+            }
+            catch (const exception& e) {
+                errors[i] = e.what();
+            }
+        }
+    });
+    threads->waitForThreads();
+    for (const string& error : errors)
+        if (!error.empty())
+            throw OpenMMException(error);
+}
+
+void XtbForceImpl::computeAdaptive(long long step, const double* boxVectors) {
+    // Move the blend one step toward the method currently selected.
+
+    if (step != lastAdaptiveStep) {
+        int numBlendSteps = max(blendSteps, 1);
+        if (useAccurateMethod)
+            blendPosition = min(blendPosition+1, numBlendSteps);
+        else
+            blendPosition = max(blendPosition-1, 0);
+        accurateWeight = blendPosition/(double) numBlendSteps;
+        lastAdaptiveStep = step;
+    }
+
+    // Compute whichever methods are needed.  On check steps we need both to estimate the error.  Only
+    // the first evaluation on each step counts as a check.
+
+    bool check = (step%checkInterval == 0 && step != lastCheckStep);
+    if (check)
+        lastCheckStep = step;
+    if (check || accurateWeight < 1.0) {
+        auto start = chrono::steady_clock::now();
+        states[0]->compute(positionVec.data(), boxVectors, contextId, step);
+        cheapTime += chrono::duration<double>(chrono::steady_clock::now()-start).count();
+        cheapEvaluations++;
+    }
+    if (check || accurateWeight > 0.0) {
+        auto start = chrono::steady_clock::now();
+        accurateState->compute(positionVec.data(), boxVectors, contextId, step);
+        accurateTime += chrono::duration<double>(chrono::steady_clock::now()-start).count();
+        accurateEvaluations++;
+    }
+    if (!check || numbers.size() == 0)
+        return;
+
+    // Estimate the error in the cheap method from the RMS difference between the forces, and decide
+    // whether to switch methods.
+
+    const vector<double>& cheapGradient = states[0]->getGradient();
+    const vector<double>& accurateGradient = accurateState->getGradient();
+    double sum = 0.0;
+    for (int i = 0; i < cheapGradient.size(); i++) {
+        double diff = accurateGradient[i]-cheapGradient[i];
+        sum += diff*diff;
+    }
+    double error = forceScale*sqrt(sum/numbers.size());
+    if (!useAccurateMethod) {
+        if (error > forceThreshold) {
+            XtbTracer::Phase phase("switchToAccurateMethod", contextId, step);
+            useAccurateMethod = true;
+            quietChecks = 0;
+            switchSteps.push_back(step);
+        }
+    }
+    else {
+        quietChecks = (error < 0.5*forceThreshold ? quietChecks+1 : 0);
+        if (quietChecks == requiredQuietChecks) {
+            XtbTracer::Phase phase("switchToCheapMethod", contextId, step);
+            useAccurateMethod = false;
+            switchSteps.push_back(step);
+        }
+    }
+}
+
+double XtbForceImpl::getStateEnergy(int index) const {
+    double energy = 0.0;
+    if (accurateWeight < 1.0)
+        energy += (1.0-accurateWeight)*states[index]->getEnergy();
+    if (accurateWeight > 0.0)
+        energy += accurateWeight*accurateState->getEnergy();
+    return energy;
+}
+
+void XtbForceImpl::getStateGradient(int index, vector<double>& gradient) const {
+    gradient.assign(3*numbers.size(), 0.0);
+    if (accurateWeight < 1.0)
+        for (int i = 0; i < gradient.size(); i++)
+            gradient[i] += (1.0-accurateWeight)*states[index]->getGradient()[i];
+    if (accurateWeight > 0.0)
+        for (int i = 0; i < gradient.size(); i++)
+            gradient[i] += accurateWeight*accurateState->getGradient()[i];
+}
+
+void XtbForceImpl::getStateEnergies(vector<double>& energies) const {
+    if (decomposition != nullptr)
+        throw OpenMMException("getElectronicStateEnergiesInContext: The energy is not computed when domain decomposition is used");
+    energies.assign(states.size(), 0.0);
+    if (appliedScale != 0.0)
+        for (int i = 0; i < states.size(); i++)
+            energies[i] = appliedScale*energyScale*getStateEnergy(i);
+}
+
+void XtbForceImpl::getVirial(vector<double>& virial) const {
+    if (!periodic)
+        throw OpenMMException("getVirialInContext: The virial is only computed when periodic boundary conditions are used");
+    if (decomposition != nullptr)
+        throw OpenMMException("getVirialInContext: The virial is not available when domain decomposition is used");
+    virial.assign(9, 0.0);
+    if (appliedScale == 0.0)
+        return;
+    for (int i = 0; i < appliedWeights.size(); i++)
+        for (int j = 0; j < 9; j++)
+            virial[j] += appliedScale*energyScale*appliedWeights[i]*states[i]->getVirial()[j];
+    if (accurateWeight > 0.0)
+        for (int j = 0; j < 9; j++)
+            virial[j] += appliedScale*energyScale*accurateWeight*accurateState->getVirial()[j];
+}
+
+void XtbForceImpl::getCharges(vector<double>& charges) const {
+    if (skippedCalculation)
+        throw OpenMMException("getChargesInContext: XTB was not called in the most recent evaluation because the scale parameter was 0");
+    int numParticles = indices.size();
+    charges.assign(numParticles, 0.0);
+    if (decomposition != nullptr) {
+        copy(decomposition->getCharges().begin(), decomposition->getCharges().begin()+numParticles, charges.begin());
+        return;
+    }
+    for (int i = 0; i < appliedWeights.size(); i++)
+        if (appliedWeights[i] != 0.0)
+            for (int j = 0; j < numParticles; j++)
+                charges[j] += appliedWeights[i]*states[i]->getCharges()[j];
+    if (accurateWeight > 0.0)
+        for (int j = 0; j < numParticles; j++)
+            charges[j] += accurateWeight*accurateState->getCharges()[j];
+}
+
+void XtbForceImpl::getStateForces(int index, vector<Vec3>& forces) const {
+    int numStates = (decomposition != nullptr ? 1 : states.size());
+    if (index < 0 || index >= numStates)
+        throw OpenMMException("getElectronicStateForcesInContext: Illegal state index");
+    forces.resize(numSystemParticles);
+    for (int i = 0; i < numSystemParticles; i++)
+        forces[i] = Vec3();
+    if (appliedScale == 0.0)
+        return;
+    vector<double> gradient;
+    if (decomposition != nullptr)
+        gradient = decomposition->getGradient();
+    else
+        getStateGradient(index, gradient);
+    addForces(gradient, appliedScale, forces);
+}
+
+void XtbForceImpl::getAdaptiveStatistics(int& cheapEvaluations, int& accurateEvaluations, double& cheapTime, double& accurateTime) const {
+    if (accurateState == nullptr)
+        throw OpenMMException("getAdaptiveMethodStatisticsInContext: The adaptive method is not being used");
+    cheapEvaluations = this->cheapEvaluations;
+    accurateEvaluations = this->accurateEvaluations;
+    cheapTime = this->cheapTime;
+    accurateTime = this->accurateTime;
+}
+
+void XtbForceImpl::getAdaptiveSwitches(vector<long long>& steps) const {
+    if (accurateState == nullptr)
+        throw OpenMMException("getAdaptiveMethodSwitchesInContext: The adaptive method is not being used");
+    steps = switchSteps;
+}
@@ -0,0 +1,222 @@
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2023 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "XtbTracer.h"
+#include "openmm/OpenMMException.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <vector>
+
+using namespace XtbPlugin;
+using namespace OpenMM;
+using namespace std;
+
+namespace {
+
+struct TraceEvent {
+    const char* name;
+    int contextId, threadId;
+    long long step, startTime, duration;
+};
+
+/**
+ * This is a single producer, single consumer ring buffer.  The thread that owns it adds events without
+ * locking, and writeTrace() removes them while holding the registry lock.
+ */
+struct ThreadBuffer {
+    static const size_t Size = 1<<16;
+    ThreadBuffer(int threadId) : threadId(threadId), events(Size), head(0), tail(0), inUse(true) {
+    }
+    int threadId;
+    vector<TraceEvent> events;
+    atomic<size_t> head, tail;
+    atomic<bool> inUse;
+};
+
+struct TraceRegistry {
+    TraceRegistry() : enabled(false), dropped(0), epoch(chrono::steady_clock::now()) {
+    }
+    atomic<bool> enabled;
+    atomic<long long> dropped;
+    chrono::steady_clock::time_point epoch;
+    mutex lock;
+    vector<ThreadBuffer*> buffers;
+    vector<TraceEvent> events;
+};
+
+atomic<int> nextContextId(1);
+
+TraceRegistry& getRegistry() {
+    static TraceRegistry registry;
+    return registry;
+}
+
+long long getTime() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-getRegistry().epoch).count();
+}
+
+/**
+ * Each thread holds one of these.  When the thread exits, its buffer is released so another thread
+ * can reuse it.  Buffers are never deleted, since they may still hold events that have not been written.
+ */
+struct ThreadBufferHolder {
+    ThreadBufferHolder() : buffer(nullptr) {
+    }
+    ~ThreadBufferHolder() {
+        if (buffer != nullptr)
+            buffer->inUse.store(false, memory_order_release);
+    }
+    ThreadBuffer* buffer;
+};
+
+ThreadBuffer& getThreadBuffer() {
+    static thread_local ThreadBufferHolder holder;
+    if (holder.buffer == nullptr) {
+        TraceRegistry& registry = getRegistry();
+        lock_guard<mutex> guard(registry.lock);
+        for (ThreadBuffer* buffer : registry.buffers) {
+            bool expected = false;
+            if (buffer->inUse.compare_exchange_strong(expected, true)) {
+                holder.buffer = buffer;
+                break;
+            }
+        }
+        if (holder.buffer == nullptr) {
+            holder.buffer = new ThreadBuffer(registry.buffers.size());
+            registry.buffers.push_back(holder.buffer);
+        }
+    }
+    return *holder.buffer;
+}
+
+void recordEvent(const TraceEvent& event) {
+    ThreadBuffer& buffer = getThreadBuffer();
+    size_t head = buffer.head.load(memory_order_relaxed);
+    if (head-buffer.tail.load(memory_order_acquire) >= ThreadBuffer::Size) {
+        getRegistry().dropped++;
+        return;
+    }
+    TraceEvent& stored = buffer.events[head%ThreadBuffer::Size];
+    stored = event;
+    stored.threadId = buffer.threadId;
+    buffer.head.store(head+1, memory_order_release);
+}
+
+/**
+ * Move all events from the thread buffers to the list of events.  The registry lock must be held.
+ */
+void drainBuffers(TraceRegistry& registry) {
+    for (ThreadBuffer* buffer : registry.buffers) {
+        size_t tail = buffer->tail.load(memory_order_relaxed);
+        size_t head = buffer->head.load(memory_order_acquire);
+        for (size_t i = tail; i < head; i++)
+            registry.events.push_back(buffer->events[i%ThreadBuffer::Size]);
+        buffer->tail.store(head, memory_order_release);
+    }
+}
+
+}
+
+void XtbTracer::setEnabled(bool enabled) {
+    getRegistry().enabled.store(enabled);
+}
+
+bool XtbTracer::isEnabled() {
+    return getRegistry().enabled.load(memory_order_relaxed);
+}
+
+void XtbTracer::writeTrace(const string& filename) {
+    TraceRegistry& registry = getRegistry();
+    lock_guard<mutex> guard(registry.lock);
+    drainBuffers(registry);
+    ofstream out(filename);
+    if (!out.is_open())
+        throw OpenMMException("XtbTracer: could not open "+filename);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    set<int> contexts;
+    for (const TraceEvent& event : registry.events)
+        contexts.insert(event.contextId);
+    bool first = true;
+    for (int id : contexts) {
+        if (!first)
+            out << ",\n";
+        first = false;
+        out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << id << ",\"args\":{\"name\":\"Context " << id << "\"}}";
+    }
+    out.setf(ios::fixed);
+    out.precision(3);
+    for (const TraceEvent& event : registry.events) {
+        if (!first)
+            out << ",\n";
+        first = false;
+        out << "{\"name\":\"" << event.name << "\",\"cat\":\"xtb\",\"ph\":\"X\",\"ts\":" << 1e-3*event.startTime <<
+                ",\"dur\":" << 1e-3*event.duration << ",\"pid\":" << event.contextId << ",\"tid\":" << event.threadId <<
+                ",\"args\":{\"step\":" << event.step << "}}";
+    }
+    out << "\n]}\n";
+    registry.events.clear();
+}
+
+void XtbTracer::clear() {
+    TraceRegistry& registry = getRegistry();
+    lock_guard<mutex> guard(registry.lock);
+    drainBuffers(registry);
+    registry.events.clear();
+    registry.dropped = 0;
+}
+
+long long XtbTracer::getNumDroppedEvents() {
+    return getRegistry().dropped.load();
+}
+
+int XtbTracer::createContextId() {
+    return nextContextId++;
+}
+
+XtbTracer::Phase::Phase(const char* name, int contextId, long long step) : name(name), contextId(contextId), step(step) {
+    startTime = (XtbTracer::isEnabled() ? getTime() : -1);
+}
+
+XtbTracer::Phase::~Phase() {
+    if (startTime < 0)
+        return;
+    TraceEvent event;
+    event.name = name;
+    event.contextId = contextId;
+    event.step = step;
+    event.startTime = startTime;
+    event.duration = getTime()-startTime;
+    recordEvent(event);
+}
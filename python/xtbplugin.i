@@ -2,9 +2,12 @@
 
 %import(module="openmm") "swig/OpenMMSwigHeaders.i"
 %include "std_vector.i"
+%include "std_string.i"
+%include "typemaps.i"
 
 %{
 #include "XtbForce.h"
+#include "XtbTracer.h"
 #include "OpenMM.h"
 #include "OpenMMAmoeba.h"
 #include "OpenMMDrude.h"
@@ -14,6 +17,8 @@
 
 namespace std {
   %template(vectori) vector<int>;
+  %template(vectord) vector<double>;
+  %template(vectorll) vector<long long>;
 };
 
 namespace XtbPlugin {
@@ -25,6 +30,10 @@ public:
         GFN2xTB = 1,
         GFNFF = 2
     };
+    enum StateCombination {
+        WeightedSum = 0,
+        MinimumEnergy = 1
+    };
     XtbForce(Method method, double charge, int multiplicity, bool periodic, const std::vector<int>& particleIndices, const std::vector<int>& atomicNumbers);
     Method getMethod() const;
     void setMethod(Method method);
@@ -32,12 +41,126 @@ public:
     void setCharge(double charge);
     int getMultiplicity() const;
     void setMultiplicity(int multiplicity);
+    int getNumElectronicStates() const;
+    int addElectronicState(double charge, int multiplicity, double weight);
+    %apply double& OUTPUT {double& charge};
+    %apply int& OUTPUT {int& multiplicity};
+    %apply double& OUTPUT {double& weight};
+    void getElectronicStateParameters(int index, double& charge, int& multiplicity, double& weight) const;
+    %clear double& charge;
+    %clear int& multiplicity;
+    %clear double& weight;
+    void setElectronicStateParameters(int index, double charge, int multiplicity, double weight);
+    StateCombination getStateCombination() const;
+    void setStateCombination(StateCombination combination);
     const std::vector<int>& getParticleIndices() const;
     void setParticleIndices(const std::vector<int>& indices);
     const std::vector<int>& getAtomicNumbers() const;
     void setAtomicNumbers(const std::vector<int>& numbers);
+    int getNumBoundaryBonds() const;
+    int addBoundaryBond(int qmParticle, int mmParticle, double scale=0.709);
+    %apply int& OUTPUT {int& qmParticle};
+    %apply int& OUTPUT {int& mmParticle};
+    %apply double& OUTPUT {double& scale};
+    void getBoundaryBondParameters(int index, int& qmParticle, int& mmParticle, double& scale) const;
+    %clear int& qmParticle;
+    %clear int& mmParticle;
+    %clear double& scale;
+    void setBoundaryBondParameters(int index, int qmParticle, int mmParticle, double scale);
     bool usesPeriodicBoundaryConditions() const;
     void setUsesPeriodicBoundaryConditions(bool periodic);
+    double getAccuracy() const;
+    void setAccuracy(double accuracy);
+    int getMaxIterations() const;
+    void setMaxIterations(int iterations);
+    double getElectronicTemperature() const;
+    void setElectronicTemperature(double temperature);
+    int getNumSchedulePhases() const;
+    int addSchedulePhase(long long startStep, double accuracy, int maxIterations, double electronicTemperature);
+    %apply long long& OUTPUT {long long& startStep};
+    %apply double& OUTPUT {double& accuracy};
+    %apply int& OUTPUT {int& maxIterations};
+    %apply double& OUTPUT {double& electronicTemperature};
+    void getSchedulePhaseParameters(int index, long long& startStep, double& accuracy, int& maxIterations, double& electronicTemperature) const;
+    %clear long long& startStep;
+    %clear double& accuracy;
+    %clear int& maxIterations;
+    %clear double& electronicTemperature;
+    void setSchedulePhaseParameters(int index, long long startStep, double accuracy, int maxIterations, double electronicTemperature);
+    double getReducedAccuracy() const;
+    void setReducedAccuracy(double accuracy);
+    int getFullAccuracyInterval() const;
+    void setFullAccuracyInterval(int interval);
+    bool getUsesDomainDecomposition() const;
+    void setUsesDomainDecomposition(bool use);
+    %apply double& OUTPUT {double& cellSize};
+    %apply double& OUTPUT {double& bufferWidth};
+    void getDomainDecompositionParameters(double& cellSize, double& bufferWidth) const;
+    %clear double& cellSize;
+    %clear double& bufferWidth;
+    void setDomainDecompositionParameters(double cellSize, double bufferWidth);
+    bool getUsesAdaptiveMethod() const;
+    void setUsesAdaptiveMethod(bool use);
+    %extend {
+        PyObject* getAdaptiveMethodParameters() const {
+            XtbPlugin::XtbForce::Method accurateMethod;
+            int checkInterval, blendSteps;
+            double forceThreshold;
+            self->getAdaptiveMethodParameters(accurateMethod, checkInterval, forceThreshold, blendSteps);
+            return Py_BuildValue("(iidi)", (int) accurateMethod, checkInterval, forceThreshold, blendSteps);
+        }
+    }
+    void setAdaptiveMethodParameters(Method accurateMethod, int checkInterval, double forceThreshold, int blendSteps);
+    const std::string& getScaleParameter() const;
+    void setScaleParameter(const std::string& name);
+    double getScaleParameterDefaultValue() const;
+    void setScaleParameterDefaultValue(double value);
+    void addEnergyParameterDerivative(const std::string& name);
+    int getNumEnergyParameterDerivatives() const;
+    const std::string& getEnergyParameterDerivativeName(int index) const;
+    %apply int& OUTPUT {int& cheapEvaluations};
+    %apply int& OUTPUT {int& accurateEvaluations};
+    %apply double& OUTPUT {double& cheapTime};
+    %apply double& OUTPUT {double& accurateTime};
+    void getAdaptiveMethodStatisticsInContext(const OpenMM::Context& context, int& cheapEvaluations, int& accurateEvaluations,
+                                              double& cheapTime, double& accurateTime) const;
+    %clear int& cheapEvaluations;
+    %clear int& accurateEvaluations;
+    %clear double& cheapTime;
+    %clear double& accurateTime;
+    void updateParametersInContext(OpenMM::Context& context);
+
+    %extend {
+        std::vector<double> getElectronicStateEnergiesInContext(const OpenMM::Context& context) {
+            std::vector<double> energies;
+            self->getElectronicStateEnergiesInContext(context, energies);
+            return energies;
+        }
+
+        std::vector<OpenMM::Vec3> getElectronicStateForcesInContext(const OpenMM::Context& context, int index) {
+            std::vector<OpenMM::Vec3> forces;
+            self->getElectronicStateForcesInContext(context, index, forces);
+            return forces;
+        }
+
+        std::vector<double> getVirialInContext(const OpenMM::Context& context) {
+            std::vector<double> virial;
+            self->getVirialInContext(context, virial);
+            return virial;
+        }
+
+        std::vector<double> getChargesInContext(const OpenMM::Context& context) {
+            std::vector<double> charges;
+            self->getChargesInContext(context, charges);
+            return charges;
+        }
+
+        std::vector<long long> getAdaptiveMethodSwitchesInContext(const OpenMM::Context& context) {
+            std::vector<long long> steps;
+            self->getAdaptiveMethodSwitchesInContext(context, steps);
+            return steps;
+        }
+    }
 
     /*
      * Add methods for casting a Force to a XtbForce.
@@ -53,4 +176,13 @@ public:
     }
 };
 
+class XtbTracer {
+public:
+    static void setEnabled(bool enabled);
+    static bool isEnabled();
+    static void writeTrace(const std::string& filename);
+    static void clear();
+    static long long getNumDroppedEvents();
+};
+
 }
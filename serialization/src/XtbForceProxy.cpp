@@ -41,12 +41,60 @@ XtbForceProxy::XtbForceProxy() : SerializationProxy("XtbForce") {
 }
 
 void XtbForceProxy::serialize(const void* object, SerializationNode& node) const {
-    node.setIntProperty("version", 0);
+    node.setIntProperty("version", 8);
     const XtbForce& force = *reinterpret_cast<const XtbForce*>(object);
     node.setIntProperty("method", (int) force.getMethod());
     node.setDoubleProperty("charge", force.getCharge());
     node.setIntProperty("multiplicity", force.getMultiplicity());
     node.setBoolProperty("periodic", force.usesPeriodicBoundaryConditions());
+    node.setDoubleProperty("accuracy", force.getAccuracy());
+    node.setIntProperty("maxIterations", force.getMaxIterations());
+    node.setDoubleProperty("electronicTemperature", force.getElectronicTemperature());
+    node.setDoubleProperty("reducedAccuracy", force.getReducedAccuracy());
+    node.setIntProperty("fullAccuracyInterval", force.getFullAccuracyInterval());
+    node.setIntProperty("stateCombination", (int) force.getStateCombination());
+    double cellSize, bufferWidth;
+    force.getDomainDecompositionParameters(cellSize, bufferWidth);
+    node.setBoolProperty("useDomainDecomposition", force.getUsesDomainDecomposition());
+    node.setDoubleProperty("cellSize", cellSize);
+    node.setDoubleProperty("bufferWidth", bufferWidth);
+    XtbForce::Method accurateMethod;
+    int checkInterval, blendSteps;
+    double forceThreshold;
+    force.getAdaptiveMethodParameters(accurateMethod, checkInterval, forceThreshold, blendSteps);
+    node.setBoolProperty("useAdaptiveMethod", force.getUsesAdaptiveMethod());
+    node.setIntProperty("accurateMethod", (int) accurateMethod);
+    node.setIntProperty("checkInterval", checkInterval);
+    node.setDoubleProperty("forceThreshold", forceThreshold);
+    node.setIntProperty("blendSteps", blendSteps);
+    node.setStringProperty("scaleParameter", force.getScaleParameter());
+    node.setDoubleProperty("scaleParameterDefaultValue", force.getScaleParameterDefaultValue());
+    auto& derivativesNode = node.createChildNode("energyParameterDerivatives");
+    for (int i = 0; i < force.getNumEnergyParameterDerivatives(); i++)
+        derivativesNode.createChildNode("derivative").setStringProperty("name", force.getEnergyParameterDerivativeName(i));
+    auto& statesNode = node.createChildNode("states");
+    for (int i = 0; i < force.getNumElectronicStates(); i++) {
+        double charge, weight;
+        int multiplicity;
+        force.getElectronicStateParameters(i, charge, multiplicity, weight);
+        statesNode.createChildNode("state").setDoubleProperty("charge", charge).setIntProperty("multiplicity", multiplicity).setDoubleProperty("weight", weight);
+    }
+    auto& bondsNode = node.createChildNode("boundaryBonds");
+    for (int i = 0; i < force.getNumBoundaryBonds(); i++) {
+        int qmParticle, mmParticle;
+        double scale;
+        force.getBoundaryBondParameters(i, qmParticle, mmParticle, scale);
+        bondsNode.createChildNode("bond").setIntProperty("qm", qmParticle).setIntProperty("mm", mmParticle).setDoubleProperty("scale", scale);
+    }
+    auto& scheduleNode = node.createChildNode("schedule");
+    for (int i = 0; i < force.getNumSchedulePhases(); i++) {
+        long long startStep;
+        double accuracy, electronicTemperature;
+        int maxIterations;
+        force.getSchedulePhaseParameters(i, startStep, accuracy, maxIterations, electronicTemperature);
+        scheduleNode.createChildNode("phase").setLongProperty("startStep", startStep).setDoubleProperty("accuracy", accuracy)
+                .setIntProperty("maxIterations", maxIterations).setDoubleProperty("electronicTemperature", electronicTemperature);
+    }
     const vector<int>& indices = force.getParticleIndices();
     auto& indicesNode = node.createChildNode("indices");
     for (int i = 0; i < indices.size(); i++)
@@ -59,7 +107,7 @@ void XtbForceProxy::serialize(const void* object, SerializationNode& node) const
 
 void* XtbForceProxy::deserialize(const SerializationNode& node) const {
     const int version = node.getIntProperty("version");
-    if (version != 0)
+    if (version < 0 || version > 8)
         throw OpenMMException("Unsupported version number");
     vector<int> indices, numbers;
     for (const auto& particle: node.getChildNode("indices").getChildren())
@@ -68,5 +116,51 @@ void* XtbForceProxy::deserialize(const SerializationNode& node) const {
         numbers.push_back(particle.getIntProperty("number"));
     XtbForce* force = new XtbForce((XtbForce::Method) node.getIntProperty("method"), node.getDoubleProperty("charge"),
             node.getIntProperty("multiplicity"), node.getBoolProperty("periodic"), indices, numbers);
+    if (version > 0) {
+        force->setReducedAccuracy(node.getDoubleProperty("reducedAccuracy"));
+        force->setFullAccuracyInterval(node.getIntProperty("fullAccuracyInterval"));
+    }
+    if (version > 1) {
+        force->setStateCombination((XtbForce::StateCombination) node.getIntProperty("stateCombination"));
+        const auto& states = node.getChildNode("states").getChildren();
+        for (int i = 0; i < states.size(); i++) {
+            const SerializationNode& state = states[i];
+            if (i == 0)
+                force->setElectronicStateParameters(0, state.getDoubleProperty("charge"), state.getIntProperty("multiplicity"), state.getDoubleProperty("weight"));
+            else
+                force->addElectronicState(state.getDoubleProperty("charge"), state.getIntProperty("multiplicity"), state.getDoubleProperty("weight"));
+        }
+    }
+    if (version > 2) {
+        force->setUsesDomainDecomposition(node.getBoolProperty("useDomainDecomposition"));
+        force->setDomainDecompositionParameters(node.getDoubleProperty("cellSize"), node.getDoubleProperty("bufferWidth"));
+    }
+    if (version > 3) {
+        force->setUsesAdaptiveMethod(node.getBoolProperty("useAdaptiveMethod"));
+        force->setAdaptiveMethodParameters((XtbForce::Method) node.getIntProperty("accurateMethod"), node.getIntProperty("checkInterval"),
+                node.getDoubleProperty("forceThreshold"), node.getIntProperty("blendSteps"));
+    }
+    if (version > 4)
+        for (const auto& bond : node.getChildNode("boundaryBonds").getChildren())
+            force->addBoundaryBond(bond.getIntProperty("qm"), bond.getIntProperty("mm"), bond.getDoubleProperty("scale"));
+    if (version > 5) {
+        force->setAccuracy(node.getDoubleProperty("accuracy"));
+        force->setMaxIterations(node.getIntProperty("maxIterations"));
+        force->setElectronicTemperature(node.getDoubleProperty("electronicTemperature"));
+        for (const auto& phase : node.getChildNode("schedule").getChildren())
+            force->addSchedulePhase(phase.getLongProperty("startStep"), phase.getDoubleProperty("accuracy"),
+                    phase.getIntProperty("maxIterations"), phase.getDoubleProperty("electronicTemperature"));
+    }
+    if (version > 6) {
+        force->setScaleParameter(node.getStringProperty("scaleParameter"));
+        force->setScaleParameterDefaultValue(node.getDoubleProperty("scaleParameterDefaultValue"));
+        if (version == 7) {
+            if (node.getBoolProperty("computeScaleDerivative"))
+                force->addEnergyParameterDerivative(force->getScaleParameter());
+        }
+        else
+            for (const auto& derivative : node.getChildNode("energyParameterDerivatives").getChildren())
+                force->addEnergyParameterDerivative(derivative.getStringProperty("name"));
+    }
     return force;
 }
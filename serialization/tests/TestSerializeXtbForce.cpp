@@ -46,6 +46,24 @@ void testSerialization() {
     // Create a Force.
 
     XtbForce force(XtbForce::GFN2xTB, 1.0, 3, true, {0, 1, 2}, {8, 1, 1});
+    force.setReducedAccuracy(5.0);
+    force.setFullAccuracyInterval(7);
+    force.addElectronicState(0.0, 2, 0.5);
+    force.setStateCombination(XtbForce::MinimumEnergy);
+    force.setUsesDomainDecomposition(true);
+    force.setDomainDecompositionParameters(1.5, 0.6);
+    force.setUsesAdaptiveMethod(true);
+    force.setAdaptiveMethodParameters(XtbForce::GFN1xTB, 5, 250.0, 3);
+    force.addBoundaryBond(0, 5, 0.72);
+    force.addBoundaryBond(2, 4);
+    force.setAccuracy(0.5);
+    force.setMaxIterations(100);
+    force.setElectronicTemperature(500.0);
+    force.addSchedulePhase(1000, 10.0, 50, 1000.0);
+    force.addSchedulePhase(50000, 0.1, 300, 300.0);
+    force.setScaleParameter("lambda");
+    force.setScaleParameterDefaultValue(0.25);
+    force.addEnergyParameterDerivative("lambda");
 
     // Serialize and then deserialize it.
 
@@ -62,6 +80,65 @@ void testSerialization() {
     ASSERT_EQUAL(force.usesPeriodicBoundaryConditions(), force2.usesPeriodicBoundaryConditions());
     ASSERT_EQUAL_CONTAINERS(force.getParticleIndices(), force2.getParticleIndices());
     ASSERT_EQUAL_CONTAINERS(force.getAtomicNumbers(), force2.getAtomicNumbers());
+    ASSERT_EQUAL(force.getReducedAccuracy(), force2.getReducedAccuracy());
+    ASSERT_EQUAL(force.getFullAccuracyInterval(), force2.getFullAccuracyInterval());
+    ASSERT_EQUAL(force.getStateCombination(), force2.getStateCombination());
+    ASSERT_EQUAL(force.getNumElectronicStates(), force2.getNumElectronicStates());
+    for (int i = 0; i < force.getNumElectronicStates(); i++) {
+        double charge1, charge2, weight1, weight2;
+        int multiplicity1, multiplicity2;
+        force.getElectronicStateParameters(i, charge1, multiplicity1, weight1);
+        force2.getElectronicStateParameters(i, charge2, multiplicity2, weight2);
+        ASSERT_EQUAL(charge1, charge2);
+        ASSERT_EQUAL(multiplicity1, multiplicity2);
+        ASSERT_EQUAL(weight1, weight2);
+    }
+    ASSERT_EQUAL(force.getUsesDomainDecomposition(), force2.getUsesDomainDecomposition());
+    double cellSize1, cellSize2, bufferWidth1, bufferWidth2;
+    force.getDomainDecompositionParameters(cellSize1, bufferWidth1);
+    force2.getDomainDecompositionParameters(cellSize2, bufferWidth2);
+    ASSERT_EQUAL(cellSize1, cellSize2);
+    ASSERT_EQUAL(bufferWidth1, bufferWidth2);
+    ASSERT_EQUAL(force.getUsesAdaptiveMethod(), force2.getUsesAdaptiveMethod());
+    XtbForce::Method method1, method2;
+    int interval1, interval2, blend1, blend2;
+    double threshold1, threshold2;
+    force.getAdaptiveMethodParameters(method1, interval1, threshold1, blend1);
+    force2.getAdaptiveMethodParameters(method2, interval2, threshold2, blend2);
+    ASSERT_EQUAL(method1, method2);
+    ASSERT_EQUAL(interval1, interval2);
+    ASSERT_EQUAL(threshold1, threshold2);
+    ASSERT_EQUAL(blend1, blend2);
+    ASSERT_EQUAL(force.getNumBoundaryBonds(), force2.getNumBoundaryBonds());
+    for (int i = 0; i < force.getNumBoundaryBonds(); i++) {
+        int qm1, qm2, mm1, mm2;
+        double scale1, scale2;
+        force.getBoundaryBondParameters(i, qm1, mm1, scale1);
+        force2.getBoundaryBondParameters(i, qm2, mm2, scale2);
+        ASSERT_EQUAL(qm1, qm2);
+        ASSERT_EQUAL(mm1, mm2);
+        ASSERT_EQUAL(scale1, scale2);
+    }
+    ASSERT_EQUAL(force.getAccuracy(), force2.getAccuracy());
+    ASSERT_EQUAL(force.getMaxIterations(), force2.getMaxIterations());
+    ASSERT_EQUAL(force.getElectronicTemperature(), force2.getElectronicTemperature());
+    ASSERT_EQUAL(force.getNumSchedulePhases(), force2.getNumSchedulePhases());
+    for (int i = 0; i < force.getNumSchedulePhases(); i++) {
+        long long start1, start2;
+        double accuracy1, accuracy2, temperature1, temperature2;
+        int iterations1, iterations2;
+        force.getSchedulePhaseParameters(i, start1, accuracy1, iterations1, temperature1);
+        force2.getSchedulePhaseParameters(i, start2, accuracy2, iterations2, temperature2);
+        ASSERT_EQUAL(start1, start2);
+        ASSERT_EQUAL(accuracy1, accuracy2);
+        ASSERT_EQUAL(iterations1, iterations2);
+        ASSERT_EQUAL(temperature1, temperature2);
+    }
+    ASSERT_EQUAL(force.getScaleParameter(), force2.getScaleParameter());
+    ASSERT_EQUAL(force.getScaleParameterDefaultValue(), force2.getScaleParameterDefaultValue());
+    ASSERT_EQUAL(force.getNumEnergyParameterDerivatives(), force2.getNumEnergyParameterDerivatives());
+    for (int i = 0; i < force.getNumEnergyParameterDerivatives(); i++)
+        ASSERT_EQUAL(force.getEnergyParameterDerivativeName(i), force2.getEnergyParameterDerivativeName(i));
 }
 
 int main() {
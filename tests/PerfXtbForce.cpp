@@ -0,0 +1,211 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2023 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This is a performance regression test for XtbForce.  It runs a fixed workload and compares
+ * the time per step to a stored budget.  It also traces a few steps and checks that the XTB molecule
+ * and parameters are only set up once, since rebuilding them on every step is the most costly
+ * regression and its cost varies too much from machine to machine to be caught by timing alone.
+ *
+ * Usage: PerfXtbForce <baseline file> <method> <periodic>
+ */
+
+#include "XtbForce.h"
+#include "XtbTracer.h"
+#include "openmm/Context.h"
+#include "openmm/LangevinMiddleIntegrator.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/Platform.h"
+#include "openmm/System.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace XtbPlugin;
+using namespace OpenMM;
+using namespace std;
+
+// ctest treats this exit code as a skipped test (see SKIP_RETURN_CODE in CMakeLists.txt).
+
+const int SKIP_RETURN_CODE = 77;
+
+// XTB only supports periodic boundary conditions with GFN-FF.  The other periodic workloads are skipped
+// without running them.  Any other failure is an error.
+
+bool isSupported(XtbForce::Method method, bool periodic) {
+    return (!periodic || method == XtbForce::GFNFF);
+}
+
+XtbForce::Method parseMethod(const string& name) {
+    if (name == "GFN1xTB")
+        return XtbForce::GFN1xTB;
+    if (name == "GFN2xTB")
+        return XtbForce::GFN2xTB;
+    if (name == "GFNFF")
+        return XtbForce::GFNFF;
+    throw OpenMMException("Unknown method: "+name);
+}
+
+void readBaseline(const string& filename, const string& method, bool periodic, double& baseline, double& budget) {
+    ifstream file(filename);
+    if (!file.is_open())
+        throw OpenMMException("Could not open baseline file: "+filename);
+    string line;
+    while (getline(file, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        stringstream fields(line);
+        string lineMethod;
+        int linePeriodic;
+        fields >> lineMethod >> linePeriodic >> baseline >> budget;
+        if (!fields.fail() && lineMethod == method && (linePeriodic != 0) == periodic)
+            return;
+    }
+    throw OpenMMException("No baseline found for "+method+(periodic ? " periodic" : " nonperiodic"));
+}
+
+/**
+ * Count how many events with a given name appear in a trace file.
+ */
+int countTraceEvents(const string& filename, const string& name) {
+    ifstream file(filename);
+    stringstream contents;
+    contents << file.rdbuf();
+    string text = contents.str();
+    string pattern = "\"name\":\""+name+"\"";
+    int count = 0;
+    for (size_t pos = text.find(pattern); pos != string::npos; pos = text.find(pattern, pos+1))
+        count++;
+    return count;
+}
+
+/**
+ * Run the workload.  This returns the time per step in ms, and the number of times the XTB molecule
+ * and parameters were set up during a series of steps after initialization.
+ */
+double timeWorkload(XtbForce::Method method, bool periodic, int& numRebuilds) {
+    // Create a cluster of eight water molecules.  When periodic boundary conditions are used,
+    // the box size gives it approximately the density of liquid water.
+
+    const int numWaters = 8;
+    const double spacing = 0.31;
+    System system;
+    vector<Vec3> positions;
+    vector<int> indices, numbers;
+    for (int i = 0; i < numWaters; i++) {
+        Vec3 center = spacing*Vec3(i%2, (i/2)%2, i/4)+Vec3(0.15, 0.15, 0.15);
+        system.addParticle(16.0);
+        system.addParticle(1.0);
+        system.addParticle(1.0);
+        positions.push_back(center);
+        positions.push_back(center+Vec3(0.0957, 0.0, 0.0));
+        positions.push_back(center+Vec3(-0.0240, 0.0927, 0.0));
+        for (int j = 0; j < 3; j++)
+            indices.push_back(3*i+j);
+        numbers.push_back(8);
+        numbers.push_back(1);
+        numbers.push_back(1);
+    }
+    double boxSize = 2*spacing;
+    system.setDefaultPeriodicBoxVectors(Vec3(boxSize, 0, 0), Vec3(0, boxSize, 0), Vec3(0, 0, boxSize));
+    system.addForce(new XtbForce(method, 0.0, 1, periodic, indices, numbers));
+    LangevinMiddleIntegrator integrator(300.0, 1.0, 0.0005);
+    integrator.setRandomNumberSeed(1);
+    Platform& platform = Platform::getPlatformByName("Reference");
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+
+    // Take a few steps to get past initialization, then time the workload.
+
+    const int warmupSteps = 5;
+    const int timedSteps = 20;
+    const int tracedSteps = 5;
+    integrator.step(warmupSteps);
+    auto start = chrono::steady_clock::now();
+    integrator.step(timedSteps);
+    context.getState(State::Energy);
+    auto end = chrono::steady_clock::now();
+
+    // Trace some more steps and count how often the molecule and parameters were set up.  This is done
+    // separately so tracing does not affect the timing.
+
+    const string traceFile = "PerfXtbForceTrace.json";
+    XtbTracer::clear();
+    XtbTracer::setEnabled(true);
+    integrator.step(tracedSteps);
+    XtbTracer::setEnabled(false);
+    XtbTracer::writeTrace(traceFile);
+    numRebuilds = countTraceEvents(traceFile, "createMolecule")+countTraceEvents(traceFile, "loadParameters");
+    remove(traceFile.c_str());
+    return chrono::duration<double, milli>(end-start).count()/timedSteps;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 4) {
+        cout << "Usage: PerfXtbForce <baseline file> <method> <periodic>" << endl;
+        return 1;
+    }
+    string methodName = argv[2];
+    bool periodic = (atoi(argv[3]) != 0);
+    string description = methodName+(periodic ? " periodic" : " nonperiodic");
+    try {
+        XtbForce::Method method = parseMethod(methodName);
+        if (!isSupported(method, periodic)) {
+            cout << description << ": skipped (not supported by XTB)" << endl;
+            return SKIP_RETURN_CODE;
+        }
+        double baseline, budget;
+        readBaseline(argv[1], methodName, periodic, baseline, budget);
+        int numRebuilds;
+        double timePerStep = timeWorkload(method, periodic, numRebuilds);
+        cout << description << ": " << timePerStep << " ms/step, baseline " << baseline << " ms/step, ratio "
+             << timePerStep/baseline << ", budget " << budget << " ms/step" << endl;
+        if (numRebuilds > 0) {
+            cout << "FAILED: the XTB molecule or parameters were set up " << numRebuilds << " times after initialization" << endl;
+            return 1;
+        }
+        if (timePerStep > budget) {
+            cout << "FAILED: time per step exceeds the budget" << endl;
+            return 1;
+        }
+    }
+    catch(const std::exception& e) {
+        std::cout << "exception: " << e.what() << std::endl;
+        return 1;
+    }
+    std::cout << "Done" << std::endl;
+    return 0;
+}
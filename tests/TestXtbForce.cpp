@@ -34,15 +34,21 @@
  */
 
 #include "XtbForce.h"
+#include "XtbTracer.h"
 #include "openmm/internal/AssertionUtilities.h"
 #include "openmm/Context.h"
 #include "openmm/CustomExternalForce.h"
 #include "openmm/LangevinMiddleIntegrator.h"
+#include "openmm/MonteCarloBarostat.h"
 #include "openmm/NonbondedForce.h"
 #include "openmm/Platform.h"
 #include "openmm/System.h"
 #include "openmm/reference/SimTKOpenMMRealType.h"
+#include <cmath>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -105,6 +111,16 @@ void testWater(Platform& platform, XtbForce::Method method) {
     context.setPositions(positions3);
     State state3 = context.getState(State::Energy);
     ASSERT_EQUAL_TOL(norm, (state2.getPotentialEnergy()-state3.getPotentialEnergy())/stepSize, 5e-3);
+
+    // The partial charges should add up to the total charge, with a negative charge on the oxygen.
+
+    vector<double> charges;
+    force->getChargesInContext(context, charges);
+    ASSERT_EQUAL(3, charges.size());
+    ASSERT_EQUAL_TOL(0.0, charges[0]+charges[1]+charges[2], 1e-4);
+    ASSERT(charges[0] < 0);
+    ASSERT(charges[1] > 0);
+    ASSERT(charges[2] > 0);
 }
 
 void testPartialSystem(Platform& platform) {
@@ -135,11 +151,707 @@ void testPartialSystem(Platform& platform) {
     ASSERT_EQUAL_VEC(zero, forces[2], 1e-5);
 }
 
+void testBoundaryBonds(Platform& platform) {
+    // Create an ethane molecule and apply XTB to only one of the methyl groups.
+
+    System system;
+    vector<Vec3> positions;
+    positions.push_back(Vec3(0.0, 0.0, 0.0));
+    positions.push_back(Vec3(-0.0363, 0.1028, 0.0));
+    positions.push_back(Vec3(-0.0363, -0.0514, 0.089));
+    positions.push_back(Vec3(-0.0363, -0.0514, -0.089));
+    positions.push_back(Vec3(0.153, 0.0, 0.0));
+    positions.push_back(Vec3(0.1893, -0.1028, 0.0));
+    positions.push_back(Vec3(0.1893, 0.0514, 0.089));
+    positions.push_back(Vec3(0.1893, 0.0514, -0.089));
+    system.addParticle(12.0);
+    for (int i = 0; i < 3; i++)
+        system.addParticle(1.0);
+    system.addParticle(12.0);
+    for (int i = 0; i < 3; i++)
+        system.addParticle(1.0);
+    XtbForce* force = new XtbForce(XtbForce::GFN2xTB, 0.0, 1, false, {0, 1, 2, 3}, {6, 1, 1, 1});
+    const double scale = 0.709;
+    force->addBoundaryBond(0, 4, scale);
+    system.addForce(force);
+    LangevinMiddleIntegrator integrator(300.0, 1.0, 0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    State state1 = context.getState(State::Energy | State::Forces);
+
+    // The energy should be the same as a methane molecule with a hydrogen at the link atom position.
+
+    System system2;
+    for (int i = 0; i < 5; i++)
+        system2.addParticle(1.0);
+    system2.addForce(new XtbForce(XtbForce::GFN2xTB, 0.0, 1, false, {0, 1, 2, 3, 4}, {6, 1, 1, 1, 1}));
+    LangevinMiddleIntegrator integrator2(300.0, 1.0, 0.001);
+    Context context2(system2, integrator2, platform);
+    vector<Vec3> positions2(positions.begin(), positions.begin()+4);
+    positions2.push_back(positions[0]+(positions[4]-positions[0])*scale);
+    context2.setPositions(positions2);
+    ASSERT_EQUAL_TOL(context2.getState(State::Energy).getPotentialEnergy(), state1.getPotentialEnergy(), 1e-6);
+
+    // The MM carbon should feel a force, but not the MM hydrogens.
+
+    const vector<Vec3>& forces = state1.getForces();
+    ASSERT(sqrt(forces[4].dot(forces[4])) > 1.0);
+    Vec3 zero;
+    for (int i = 5; i < 8; i++)
+        ASSERT_EQUAL_VEC(zero, forces[i], 1e-5);
+
+    // Make sure the force is the gradient of the energy.
+
+    double norm = 0.0;
+    for (int i = 0; i < forces.size(); i++)
+        norm += forces[i].dot(forces[i]);
+    norm = sqrt(norm);
+    const double stepSize = 1e-4;
+    double step = 0.5*stepSize/norm;
+    vector<Vec3> positions3(positions.size()), positions4(positions.size());
+    for (int i = 0; i < positions.size(); i++) {
+        positions3[i] = positions[i]-forces[i]*step;
+        positions4[i] = positions[i]+forces[i]*step;
+    }
+    context.setPositions(positions3);
+    State state3 = context.getState(State::Energy);
+    context.setPositions(positions4);
+    State state4 = context.getState(State::Energy);
+    ASSERT_EQUAL_TOL(norm, (state3.getPotentialEnergy()-state4.getPotentialEnergy())/stepSize, 5e-3);
+}
+
+void testReducedAccuracy(Platform& platform) {
+    // Create two Contexts for the same System.  The second one uses a reduced SCC accuracy between full
+    // accuracy steps.
+
+    System system;
+    system.addParticle(16.0);
+    system.addParticle(1.0);
+    system.addParticle(1.0);
+    vector<Vec3> positions(3);
+    positions[0] = Vec3(0.1593, 0.7872, 0.5138);
+    positions[1] = Vec3(0.1917, 0.7084, 0.4703);
+    positions[2] = Vec3(0.2379, 0.8298, 0.5481);
+    XtbForce* force = new XtbForce(XtbForce::GFN2xTB, 0.0, 1, false, {0, 1, 2}, {8, 1, 1});
+    system.addForce(force);
+    LangevinMiddleIntegrator defaultIntegrator(300.0, 1.0, 0.001);
+    Context defaultContext(system, defaultIntegrator, platform);
+    force->setReducedAccuracy(10.0);
+    force->setFullAccuracyInterval(5);
+    LangevinMiddleIntegrator reducedIntegrator(300.0, 1.0, 0.001);
+    Context reducedContext(system, reducedIntegrator, platform);
+    defaultContext.setStepCount(1);
+    reducedContext.setStepCount(1);
+
+    // Evaluate a sequence of slightly different conformations.  The energies should agree to within
+    // the SCC tolerance.
+
+    for (int i = 0; i < 5; i++) {
+        positions[1][0] += 0.001;
+        defaultContext.setPositions(positions);
+        reducedContext.setPositions(positions);
+        double defaultEnergy = defaultContext.getState(State::Energy).getPotentialEnergy();
+        double reducedEnergy = reducedContext.getState(State::Energy).getPotentialEnergy();
+        ASSERT_EQUAL_TOL(defaultEnergy, reducedEnergy, 1e-5);
+    }
+}
+
+void testSCCSettings(Platform& platform) {
+    // A stretched hydrogen molecule has a small gap, so its energy depends on the electronic temperature.
+
+    System system;
+    system.addParticle(1.0);
+    system.addParticle(1.0);
+    vector<Vec3> positions = {Vec3(0, 0, 0), Vec3(0.2, 0, 0)};
+    XtbForce* force = new XtbForce(XtbForce::GFN2xTB, 0.0, 1, false, {0, 1}, {1, 1});
+    system.addForce(force);
+    LangevinMiddleIntegrator integrator(300.0, 1.0, 0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    double energy1 = context.getState(State::Energy).getPotentialEnergy();
+
+    // Changing the electronic temperature should change the energy.
+
+    force->setElectronicTemperature(5000.0);
+    force->updateParametersInContext(context);
+    double energy2 = context.getState(State::Energy).getPotentialEnergy();
+    ASSERT(fabs(energy2-energy1) > 1e-3);
+
+    // A phase of the schedule that has begun should override the default settings.
+
+    force->setElectronicTemperature(300.0);
+    force->addSchedulePhase(0, 1.0, 250, 5000.0);
+    force->updateParametersInContext(context);
+    ASSERT_EQUAL_TOL(energy2, context.getState(State::Energy).getPotentialEnergy(), 1e-6);
+
+    // A phase that has not begun yet should have no effect until the simulation reaches it.
+
+    force->setSchedulePhaseParameters(0, 10, 1.0, 250, 5000.0);
+    force->updateParametersInContext(context);
+    ASSERT_EQUAL_TOL(energy1, context.getState(State::Energy).getPotentialEnergy(), 1e-6);
+    context.setStepCount(10);
+    ASSERT_EQUAL_TOL(energy2, context.getState(State::Energy).getPotentialEnergy(), 1e-6);
+
+    // Invalid settings should be rejected.
+
+    bool threwException = false;
+    try {
+        force->setMaxIterations(0);
+    }
+    catch (const OpenMMException& ex) {
+        threwException = true;
+    }
+    ASSERT(threwException);
+}
+
+void testElectronicStates(Platform& platform) {
+    // Create a water molecule with a neutral and a cationic state.
+
+    System system;
+    system.addParticle(16.0);
+    system.addParticle(1.0);
+    system.addParticle(1.0);
+    vector<Vec3> positions(3);
+    positions[0] = Vec3(0.1593, 0.7872, 0.5138);
+    positions[1] = Vec3(0.1917, 0.7084, 0.4703);
+    positions[2] = Vec3(0.2379, 0.8298, 0.5481);
+    XtbForce* force = new XtbForce(XtbForce::GFN2xTB, 0.0, 1, false, {0, 1, 2}, {8, 1, 1});
+    force->addElectronicState(1.0, 2, 0.0);
+    system.addForce(force);
+    LangevinMiddleIntegrator integrator1(300.0, 1.0, 0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+
+    // With the default weights, only the neutral state contributes.
+
+    State state1 = context1.getState(State::Energy | State::Forces);
+    vector<double> energies;
+    force->getElectronicStateEnergiesInContext(context1, energies);
+    ASSERT_EQUAL(2, energies.size());
+    ASSERT_EQUAL_TOL(energies[0], state1.getPotentialEnergy(), 1e-6);
+    ASSERT(energies[1] > energies[0]);
+    vector<Vec3> stateForces[2];
+    force->getElectronicStateForcesInContext(context1, 0, stateForces[0]);
+    force->getElectronicStateForcesInContext(context1, 1, stateForces[1]);
+    for (int i = 0; i < 3; i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], stateForces[0][i], 1e-6);
+
+    // Try a weighted sum of the two states.
+
+    force->setElectronicStateParameters(0, 0.0, 1, 0.25);
+    force->setElectronicStateParameters(1, 1.0, 2, 0.75);
+    LangevinMiddleIntegrator integrator2(300.0, 1.0, 0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    State state2 = context2.getState(State::Energy | State::Forces);
+    ASSERT_EQUAL_TOL(0.25*energies[0]+0.75*energies[1], state2.getPotentialEnergy(), 1e-5);
+    for (int i = 0; i < 3; i++)
+        ASSERT_EQUAL_VEC(stateForces[0][i]*0.25+stateForces[1][i]*0.75, state2.getForces()[i], 1e-4);
+
+    // Selecting the lowest energy state should give the neutral state.
+
+    force->setStateCombination(XtbForce::MinimumEnergy);
+    LangevinMiddleIntegrator integrator3(300.0, 1.0, 0.001);
+    Context context3(system, integrator3, platform);
+    context3.setPositions(positions);
+    ASSERT_EQUAL_TOL(energies[0], context3.getState(State::Energy).getPotentialEnergy(), 1e-5);
+
+    // The states are computed in parallel.  Take some steps, and check that the results match
+    // computing each state on its own.  This cannot show that XTB is safe to call from several
+    // threads, but it catches interference that affects the results.
+
+    integrator1.step(10);
+    State positionState = context1.getState(State::Positions | State::Energy);
+    force->getElectronicStateEnergiesInContext(context1, energies);
+    for (int i = 0; i < 2; i++) {
+        System system4;
+        for (int j = 0; j < 3; j++)
+            system4.addParticle(system.getParticleMass(j));
+        system4.addForce(new XtbForce(XtbForce::GFN2xTB, (double) i, i+1, false, {0, 1, 2}, {8, 1, 1}));
+        LangevinMiddleIntegrator integrator4(300.0, 1.0, 0.001);
+        Context context4(system4, integrator4, platform);
+        context4.setPositions(positionState.getPositions());
+        ASSERT_EQUAL_TOL(context4.getState(State::Energy).getPotentialEnergy(), energies[i], 1e-5);
+    }
+}
+
+void testSpinStates(Platform& platform) {
+    // Compute an oxygen molecule as a singlet and a triplet.  The triplet is the ground state, so it
+    // should have a substantially lower energy.
+
+    System system;
+    system.addParticle(16.0);
+    system.addParticle(16.0);
+    vector<Vec3> positions(2);
+    positions[1] = Vec3(0.121, 0.0, 0.0);
+    XtbForce* force = new XtbForce(XtbForce::GFN2xTB, 0.0, 1, false, {0, 1}, {8, 8});
+    force->addElectronicState(0.0, 3, 0.0);
+    system.addForce(force);
+    LangevinMiddleIntegrator integrator(300.0, 1.0, 0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    context.getState(State::Energy);
+    vector<double> energies;
+    force->getElectronicStateEnergiesInContext(context, energies);
+    ASSERT_EQUAL(2, energies.size());
+    ASSERT(energies[1] < energies[0]-10.0);
+}
+
+void testUpdateParametersInContext(Platform& platform) {
+    // Create a system with two water molecules, only one of which is computed with XTB.
+
+    System system;
+    vector<Vec3> positions(6);
+    for (int i = 0; i < 2; i++) {
+        system.addParticle(16.0);
+        system.addParticle(1.0);
+        system.addParticle(1.0);
+        Vec3 offset(0.5*i, 0, 0);
+        positions[3*i] = Vec3(0.1593, 0.7872, 0.5138)+offset;
+        positions[3*i+1] = Vec3(0.1917, 0.7084, 0.4703)+offset;
+        positions[3*i+2] = Vec3(0.2379, 0.8298, 0.5481)+offset;
+    }
+    XtbForce* force = new XtbForce(XtbForce::GFN2xTB, 0.0, 1, false, {0, 1, 2}, {8, 1, 1});
+    system.addForce(force);
+    LangevinMiddleIntegrator integrator(300.0, 1.0, 0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    double initialEnergy = context.getState(State::Energy).getPotentialEnergy();
+
+    // Each change should give the same result as creating a new Context.
+
+    auto compareToNewContext = [&] () -> double {
+        State state1 = context.getState(State::Energy | State::Forces);
+        LangevinMiddleIntegrator integrator2(300.0, 1.0, 0.001);
+        Context context2(system, integrator2, platform);
+        context2.setPositions(positions);
+        State state2 = context2.getState(State::Energy | State::Forces);
+        ASSERT_EQUAL_TOL(state2.getPotentialEnergy(), state1.getPotentialEnergy(), 1e-5);
+        for (int i = 0; i < system.getNumParticles(); i++)
+            ASSERT_EQUAL_VEC(state2.getForces()[i], state1.getForces()[i], 1e-3);
+        return state1.getPotentialEnergy();
+    };
+    force->setCharge(1.0);
+    force->setMultiplicity(2);
+    force->updateParametersInContext(context);
+    ASSERT(compareToNewContext() != initialEnergy);
+    force->setCharge(0.0);
+    force->setMultiplicity(1);
+    force->setMethod(XtbForce::GFN1xTB);
+    force->updateParametersInContext(context);
+    compareToNewContext();
+    force->setParticleIndices({3, 4, 5});
+    force->updateParametersInContext(context);
+    compareToNewContext();
+    force->addElectronicState(1.0, 2, 0.5);
+    force->updateParametersInContext(context);
+    compareToNewContext();
+    force->setParticleIndices({0, 1, 2, 3, 4, 5});
+    force->setAtomicNumbers({8, 1, 1, 8, 1, 1});
+    force->updateParametersInContext(context);
+    compareToNewContext();
+}
+
+void testPeriodicBoxChanges(Platform& platform) {
+    // Create a periodic system with a few water molecules.
+
+    System system;
+    vector<Vec3> positions;
+    vector<int> indices, numbers;
+    for (int i = 0; i < 4; i++) {
+        system.addParticle(16.0);
+        system.addParticle(1.0);
+        system.addParticle(1.0);
+        Vec3 center(0.3*(i%2)+0.15, 0.3*(i/2)+0.15, 0.2);
+        positions.push_back(center);
+        positions.push_back(center+Vec3(0.0957, 0.0, 0.0));
+        positions.push_back(center+Vec3(-0.0240, 0.0927, 0.0));
+        for (int j = 0; j < 3; j++)
+            indices.push_back(3*i+j);
+        numbers.push_back(8);
+        numbers.push_back(1);
+        numbers.push_back(1);
+    }
+    system.setDefaultPeriodicBoxVectors(Vec3(0.6, 0, 0), Vec3(0, 0.6, 0), Vec3(0, 0, 0.4));
+    XtbForce* force = new XtbForce(XtbForce::GFNFF, 0.0, 1, true, indices, numbers);
+    system.addForce(force);
+    LangevinMiddleIntegrator integrator(300.0, 1.0, 0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    State state1 = context.getState(State::Energy | State::Forces);
+    vector<double> virial;
+    force->getVirialInContext(context, virial);
+    ASSERT_EQUAL(9, virial.size());
+
+    // Scale the box and positions as a barostat would, then return to the original box.  The results
+    // should be identical to the ones before the change.
+
+    double scale = 1.01;
+    vector<Vec3> scaledPositions(positions.size());
+    for (int i = 0; i < positions.size(); i++)
+        scaledPositions[i] = positions[i]*scale;
+    context.setPeriodicBoxVectors(Vec3(0.6*scale, 0, 0), Vec3(0, 0.6*scale, 0), Vec3(0, 0, 0.4*scale));
+    context.setPositions(scaledPositions);
+    State state2 = context.getState(State::Energy);
+    ASSERT(state1.getPotentialEnergy() != state2.getPotentialEnergy());
+    context.setPeriodicBoxVectors(Vec3(0.6, 0, 0), Vec3(0, 0.6, 0), Vec3(0, 0, 0.4));
+    context.setPositions(positions);
+    State state3 = context.getState(State::Energy | State::Forces);
+    ASSERT_EQUAL(state1.getPotentialEnergy(), state3.getPotentialEnergy());
+    for (int i = 0; i < positions.size(); i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state3.getForces()[i], 1e-10);
+
+    // Going to the scaled box again should give the same energy as computing it from scratch.
+
+    context.setPeriodicBoxVectors(Vec3(0.6*scale, 0, 0), Vec3(0, 0.6*scale, 0), Vec3(0, 0, 0.4*scale));
+    context.setPositions(scaledPositions);
+    ASSERT_EQUAL_TOL(state2.getPotentialEnergy(), context.getState(State::Energy).getPotentialEnergy(), 1e-6);
+
+    // Make sure a simulation with a barostat runs.
+
+    system.addForce(new MonteCarloBarostat(1.0, 300.0, 2));
+    LangevinMiddleIntegrator integrator2(300.0, 1.0, 0.0005);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    integrator2.step(10);
+    ASSERT(!std::isnan(context2.getState(State::Energy).getPotentialEnergy()));
+}
+
+void testDomainDecomposition(Platform& platform) {
+    // Create a periodic system with one water molecule in each of eight cells.  The molecules are
+    // farther apart than the buffer width, so the cells should be nearly independent and domain
+    // decomposition should closely reproduce a calculation on the whole system.  One molecule
+    // crosses the periodic boundary, so its atoms are in different cells.
+
+    System system;
+    vector<Vec3> positions;
+    vector<int> indices, numbers;
+    for (int i = 0; i < 8; i++) {
+        system.addParticle(16.0);
+        system.addParticle(1.0);
+        system.addParticle(1.0);
+        Vec3 center(1.0*(i%2)+0.5, 1.0*((i/2)%2)+0.5, 1.0*(i/4)+0.5);
+        if (i == 1)
+            center[0] = 1.97;
+        positions.push_back(center);
+        positions.push_back(center+Vec3(0.0957, 0.0, 0.0));
+        positions.push_back(center+Vec3(-0.0240, 0.0927, 0.0));
+        for (int j = 0; j < 3; j++)
+            indices.push_back(3*i+j);
+        numbers.push_back(8);
+        numbers.push_back(1);
+        numbers.push_back(1);
+    }
+    system.setDefaultPeriodicBoxVectors(Vec3(2.0, 0, 0), Vec3(0, 2.0, 0), Vec3(0, 0, 2.0));
+    XtbForce* force = new XtbForce(XtbForce::GFNFF, 0.0, 1, true, indices, numbers);
+    system.addForce(force);
+    LangevinMiddleIntegrator integrator(300.0, 1.0, 0.0005);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    LangevinMiddleIntegrator referenceIntegrator(300.0, 1.0, 0.0005);
+    Context referenceContext(system, referenceIntegrator, platform);
+    referenceContext.setPositions(positions);
+    State state1 = referenceContext.getState(State::Forces);
+
+    // Switch to domain decomposition and compare the results.
+
+    force->setUsesDomainDecomposition(true);
+    force->setDomainDecompositionParameters(1.0, 0.3);
+    force->updateParametersInContext(context);
+    State state2 = context.getState(State::Forces);
+    for (int i = 0; i < positions.size(); i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 0.05);
+
+    // The energy is not computed, so requesting it should throw an exception.
+
+    bool threwException = false;
+    try {
+        context.getState(State::Energy);
+    }
+    catch (const OpenMMException& ex) {
+        threwException = true;
+    }
+    ASSERT(threwException);
+
+    // A box that only holds one cell along each axis should use periodic images of the atoms as the buffer.
+
+    force->setDomainDecompositionParameters(1.5, 0.3);
+    force->updateParametersInContext(context);
+    State state3 = context.getState(State::Forces);
+    for (int i = 0; i < positions.size(); i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state3.getForces()[i], 0.05);
+
+    // Move the molecule that straddles the boundary so its oxygen crosses the face of the box.  The first
+    // move is less than half the skin distance (a quarter of the buffer width), so the atoms are not
+    // reassigned to cells and the oxygen must be placed relative to where it was assigned.  The second
+    // move causes them to be reassigned.  Both should agree with a calculation on the whole system.
+
+    force->setDomainDecompositionParameters(1.0, 0.3);
+    force->updateParametersInContext(context);
+    context.getState(State::Forces);
+    vector<Vec3> movedPositions = positions;
+    for (int move = 0; move < 2; move++) {
+        for (int i = 3; i < 6; i++)
+            movedPositions[i][0] += 0.035;
+        context.setPositions(movedPositions);
+        referenceContext.setPositions(movedPositions);
+        State referenceState = referenceContext.getState(State::Forces);
+        State movedState = context.getState(State::Forces);
+        for (int i = 0; i < positions.size(); i++)
+            ASSERT_EQUAL_VEC(referenceState.getForces()[i], movedState.getForces()[i], 0.05);
+    }
+
+    // Run a simulation to make sure atoms can be reassigned to cells.
+
+    integrator.step(20);
+    State state4 = context.getState(State::Forces);
+    for (int i = 0; i < positions.size(); i++)
+        ASSERT(!std::isnan(state4.getForces()[i][0]) && !std::isnan(state4.getForces()[i][1]) && !std::isnan(state4.getForces()[i][2]));
+
+    // Methods other than GFNFF should be rejected.
+
+    force->setMethod(XtbForce::GFN2xTB);
+    threwException = false;
+    try {
+        force->updateParametersInContext(context);
+    }
+    catch (const OpenMMException& ex) {
+        threwException = true;
+    }
+    ASSERT(threwException);
+}
+
+void testAdaptiveMethod(Platform& platform) {
+    // Create a system with two water molecules.
+
+    System system;
+    vector<Vec3> positions;
+    vector<int> indices, numbers;
+    for (int i = 0; i < 2; i++) {
+        system.addParticle(16.0);
+        system.addParticle(1.0);
+        system.addParticle(1.0);
+        Vec3 center(0.3*i, 0.0, 0.0);
+        positions.push_back(center);
+        positions.push_back(center+Vec3(0.0957, 0.0, 0.0));
+        positions.push_back(center+Vec3(-0.0240, 0.0927, 0.0));
+        for (int j = 0; j < 3; j++)
+            indices.push_back(3*i+j);
+        numbers.push_back(8);
+        numbers.push_back(1);
+        numbers.push_back(1);
+    }
+    XtbForce* force = new XtbForce(XtbForce::GFNFF, 0.0, 1, false, indices, numbers);
+    system.addForce(force);
+
+    // With a threshold of 0, it should switch to the accurate method on the first check.  Once the
+    // blending is finished, the energy should match the accurate method.
+
+    force->setUsesAdaptiveMethod(true);
+    force->setAdaptiveMethodParameters(XtbForce::GFN2xTB, 2, 0.0, 4);
+    LangevinMiddleIntegrator integrator(300.0, 1.0, 0.0005);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    integrator.step(10);
+    vector<long long> switches;
+    force->getAdaptiveMethodSwitchesInContext(context, switches);
+    ASSERT_EQUAL(1, switches.size());
+    ASSERT_EQUAL(0, switches[0]);
+    State state = context.getState(State::Positions | State::Energy);
+    auto computeEnergy = [&] (XtbForce::Method method) -> double {
+        System system2;
+        for (int i = 0; i < system.getNumParticles(); i++)
+            system2.addParticle(system.getParticleMass(i));
+        system2.addForce(new XtbForce(method, 0.0, 1, false, indices, numbers));
+        LangevinMiddleIntegrator integrator2(300.0, 1.0, 0.0005);
+        Context context2(system2, integrator2, platform);
+        context2.setPositions(state.getPositions());
+        return context2.getState(State::Energy).getPotentialEnergy();
+    };
+    ASSERT_EQUAL_TOL(computeEnergy(XtbForce::GFN2xTB), state.getPotentialEnergy(), 1e-5);
+
+    // With a very large threshold, it should switch back to the cheap method.
+
+    force->setAdaptiveMethodParameters(XtbForce::GFN2xTB, 2, 1e6, 4);
+    force->updateParametersInContext(context);
+    integrator.step(20);
+    force->getAdaptiveMethodSwitchesInContext(context, switches);
+    ASSERT_EQUAL(2, switches.size());
+    state = context.getState(State::Positions | State::Energy);
+    ASSERT_EQUAL_TOL(computeEnergy(XtbForce::GFNFF), state.getPotentialEnergy(), 1e-5);
+    int cheapEvaluations, accurateEvaluations;
+    double cheapTime, accurateTime;
+    force->getAdaptiveMethodStatisticsInContext(context, cheapEvaluations, accurateEvaluations, cheapTime, accurateTime);
+    ASSERT(cheapEvaluations > 0);
+    ASSERT(accurateEvaluations > 0);
+    ASSERT(cheapTime > 0.0);
+    ASSERT(accurateTime > 0.0);
+}
+
+void testScaleParameter(Platform& platform) {
+    // Create a system with a single water molecule whose energy is scaled by a global parameter.
+
+    System system;
+    system.addParticle(16.0);
+    system.addParticle(1.0);
+    system.addParticle(1.0);
+    vector<Vec3> positions(3);
+    positions[0] = Vec3(0.1593, 0.7872, 0.5138);
+    positions[1] = Vec3(0.1917, 0.7084, 0.4703);
+    positions[2] = Vec3(0.2379, 0.8298, 0.5481);
+    XtbForce* force = new XtbForce(XtbForce::GFNFF, 0.0, 1, false, {0, 1, 2}, {8, 1, 1});
+    force->setScaleParameter("lambda");
+    system.addForce(force);
+    LangevinMiddleIntegrator integrator(300.0, 1.0, 0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    ASSERT_EQUAL(1.0, context.getParameter("lambda"));
+    State state1 = context.getState(State::Energy | State::Forces);
+
+    // The energy and forces should be proportional to the parameter.
+
+    context.setParameter("lambda", 0.4);
+    State state2 = context.getState(State::Energy | State::Forces);
+    ASSERT_EQUAL_TOL(0.4*state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-5);
+    for (int i = 0; i < 3; i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i]*0.4, state2.getForces()[i], 1e-5);
+    vector<double> energies, charges;
+    vector<Vec3> stateForces;
+    force->getElectronicStateEnergiesInContext(context, energies);
+    force->getElectronicStateForcesInContext(context, 0, stateForces);
+    force->getChargesInContext(context, charges);
+    ASSERT_EQUAL_TOL(state2.getPotentialEnergy(), energies[0], 1e-5);
+    for (int i = 0; i < 3; i++)
+        ASSERT_EQUAL_VEC(state2.getForces()[i], stateForces[i], 1e-5);
+    context.setParameter("lambda", 0.0);
+    State state3 = context.getState(State::Energy | State::Forces);
+    ASSERT_EQUAL(0.0, state3.getPotentialEnergy());
+    Vec3 zero;
+    for (int i = 0; i < 3; i++)
+        ASSERT_EQUAL_VEC(zero, state3.getForces()[i], 1e-10);
+
+    // XTB was skipped, so the results from the previous evaluation should not be reported.
+
+    force->getElectronicStateEnergiesInContext(context, energies);
+    force->getElectronicStateForcesInContext(context, 0, stateForces);
+    ASSERT_EQUAL(0.0, energies[0]);
+    for (int i = 0; i < 3; i++)
+        ASSERT_EQUAL_VEC(zero, stateForces[i], 1e-10);
+    bool threwException = false;
+    try {
+        force->getChargesInContext(context, charges);
+    }
+    catch (const OpenMMException& ex) {
+        threwException = true;
+    }
+    ASSERT(threwException);
+
+    // The derivative with respect to the parameter is the unscaled energy, even when the parameter is 0.
+    // It is only supported on the Reference and CPU platforms.
+
+    threwException = false;
+    try {
+        force->addEnergyParameterDerivative("mu");
+    }
+    catch (const OpenMMException& ex) {
+        threwException = true;
+    }
+    ASSERT(threwException);
+    force->setScaleParameterDefaultValue(0.0);
+    force->addEnergyParameterDerivative("lambda");
+    ASSERT_EQUAL(1, force->getNumEnergyParameterDerivatives());
+    ASSERT_EQUAL("lambda", force->getEnergyParameterDerivativeName(0));
+    LangevinMiddleIntegrator integrator2(300.0, 1.0, 0.001);
+    if (platform.getName() != "Reference" && platform.getName() != "CPU") {
+        threwException = false;
+        try {
+            Context context2(system, integrator2, platform);
+        }
+        catch (const OpenMMException& ex) {
+            threwException = true;
+        }
+        ASSERT(threwException);
+        return;
+    }
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    State state4 = context2.getState(State::Energy | State::ParameterDerivatives);
+    ASSERT_EQUAL(0.0, state4.getPotentialEnergy());
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state4.getEnergyParameterDerivatives().at("lambda"), 1e-5);
+    context2.setParameter("lambda", 0.7);
+    State state5 = context2.getState(State::Energy | State::ParameterDerivatives);
+    ASSERT_EQUAL_TOL(0.7*state1.getPotentialEnergy(), state5.getPotentialEnergy(), 1e-5);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state5.getEnergyParameterDerivatives().at("lambda"), 1e-5);
+}
+
+void testTracer(Platform& platform) {
+    // Create a system with a single water molecule.
+
+    System system;
+    system.addParticle(16.0);
+    system.addParticle(1.0);
+    system.addParticle(1.0);
+    vector<Vec3> positions(3);
+    positions[0] = Vec3(0.1593, 0.7872, 0.5138);
+    positions[1] = Vec3(0.1917, 0.7084, 0.4703);
+    positions[2] = Vec3(0.2379, 0.8298, 0.5481);
+    system.addForce(new XtbForce(XtbForce::GFNFF, 0.0, 1, false, {0, 1, 2}, {8, 1, 1}));
+    LangevinMiddleIntegrator integrator(300.0, 1.0, 0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+
+    // Record a few steps and write the trace.
+
+    XtbTracer::clear();
+    XtbTracer::setEnabled(true);
+    integrator.step(3);
+    XtbTracer::setEnabled(false);
+    auto writeTrace = [] () -> string {
+        string filename = "TestXtbTracer.json";
+        XtbTracer::writeTrace(filename);
+        ifstream file(filename);
+        stringstream buffer;
+        buffer << file.rdbuf();
+        file.close();
+        remove(filename.c_str());
+        return buffer.str();
+    };
+    string trace = writeTrace();
+
+    // Check that every phase was recorded.
+
+    ASSERT(trace.find("\"traceEvents\"") != string::npos);
+    ASSERT(trace.find("\"createMolecule\"") != string::npos);
+    ASSERT(trace.find("\"loadParameters\"") != string::npos);
+    ASSERT(trace.find("\"updateMolecule\"") != string::npos);
+    ASSERT(trace.find("\"singlepoint\"") != string::npos);
+    ASSERT(trace.find("\"scatterForces\"") != string::npos);
+    ASSERT_EQUAL(0, XtbTracer::getNumDroppedEvents());
+
+    // Writing the trace should have discarded the events.
+
+    trace = writeTrace();
+    ASSERT(trace.find("\"traceEvents\"") != string::npos);
+    ASSERT(trace.find("\"singlepoint\"") == string::npos);
+    XtbTracer::clear();
+}
+
 void testPlatform(Platform& platform) {
     testWater(platform, XtbForce::GFN1xTB);
     testWater(platform, XtbForce::GFN2xTB);
     testWater(platform, XtbForce::GFNFF);
     testPartialSystem(platform);
+    testBoundaryBonds(platform);
+    testReducedAccuracy(platform);
+    testSCCSettings(platform);
+    testElectronicStates(platform);
+    testSpinStates(platform);
+    testUpdateParametersInContext(platform);
+    testPeriodicBoxChanges(platform);
+    testDomainDecomposition(platform);
+    testAdaptiveMethod(platform);
+    testScaleParameter(platform);
+    testTracer(platform);
 }
 
 int main() {
@@ -0,0 +1,419 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2023 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This program recomputes the XTB energy, forces, and partial charges for every frame of a trajectory.
+ *
+ * Usage: XtbRescore <system.xml> <trajectory> <output> [number of threads]
+ *
+ * The number of threads defaults to 1.  When using more, set OMP_NUM_THREADS=1 so that each XTB calculation
+ * runs on a single processor.
+ *
+ * The System is read from a file created with XmlSerializer.  It must contain an XtbForce, and all other
+ * forces are ignored.  The trajectory is either a DCD file (if its name ends in .dcd) or a raw stream of
+ * frames.  Each raw frame consists of the three periodic box vectors followed by the positions of all
+ * particles in the System, all stored as native byte order doubles in nm.
+ *
+ * The output file begins with a 32 byte header:
+ *
+ *   char[8]  magic         "XTBSCORE"
+ *   int32    version       currently 1
+ *   int32    numAtoms      the number of particles the XtbForce is applied to
+ *   int64    numFrames     the number of frames
+ *   int64    recordSize    the size in bytes of each record
+ *
+ * It is followed by one fixed size record for each frame, in the same order as the trajectory.  Each
+ * record contains only doubles:
+ *
+ *   energy                 the potential energy in kJ/mol
+ *   forces[3*numAtoms]     the force on each particle in kJ/mol/nm
+ *   charges[numAtoms]      the partial charge of each particle in units of the proton charge
+ *
+ * Particles appear in the order of the XtbForce's particle indices.
+ */
+
+#include "XtbForce.h"
+#include "openmm/Context.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/Platform.h"
+#include "openmm/System.h"
+#include "openmm/VerletIntegrator.h"
+#include "openmm/internal/ThreadPool.h"
+#include "openmm/serialization/XmlSerializer.h"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace XtbPlugin;
+using namespace OpenMM;
+using namespace std;
+
+/**
+ * A read-only memory mapping of a file.  Pages are loaded on demand as frames are read, so the file
+ * never needs to fit in memory.
+ */
+class MappedFile {
+public:
+    MappedFile(const string& filename) : data(nullptr), size(0) {
+        fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw OpenMMException("Could not open trajectory file: "+filename);
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            throw OpenMMException("Could not read trajectory file: "+filename);
+        }
+        size = info.st_size;
+        if (size > 0) {
+            void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                close(fd);
+                throw OpenMMException("Could not map trajectory file: "+filename);
+            }
+            data = (const char*) mapping;
+            madvise(mapping, size, MADV_SEQUENTIAL);
+        }
+    }
+    ~MappedFile() {
+        if (data != nullptr)
+            munmap((void*) data, size);
+        close(fd);
+    }
+    const char* getData() const {
+        return data;
+    }
+    size_t getSize() const {
+        return size;
+    }
+private:
+    int fd;
+    const char* data;
+    size_t size;
+};
+
+/**
+ * Convert unit cell lengths and angles to box vectors in OpenMM's reduced form.
+ */
+void computeBoxVectors(double a, double b, double c, double cosAlpha, double cosBeta, double cosGamma, Vec3* box) {
+    double sinGamma = sqrt(1-cosGamma*cosGamma);
+    box[0] = Vec3(a, 0, 0);
+    box[1] = Vec3(b*cosGamma, b*sinGamma, 0);
+    double cx = c*cosBeta;
+    double cy = c*(cosAlpha-cosBeta*cosGamma)/sinGamma;
+    box[2] = Vec3(cx, cy, sqrt(c*c-cx*cx-cy*cy));
+    box[2] -= box[1]*round(box[2][1]/box[1][1]);
+    box[2] -= box[0]*round(box[2][0]/box[0][0]);
+    box[1] -= box[0]*round(box[1][0]/box[0][0]);
+}
+
+/**
+ * This is the interface for reading frames from a trajectory.  Frames can be read in any order and from
+ * multiple threads at once.
+ */
+class TrajectoryReader {
+public:
+    virtual ~TrajectoryReader() {
+    }
+    virtual long long getNumFrames() const = 0;
+    virtual void readFrame(long long frame, vector<Vec3>& positions, Vec3* box) const = 0;
+};
+
+/**
+ * Reads frames from a DCD file in the CHARMM format written by OpenMM, CHARMM, and NAMD.
+ */
+class DcdReader : public TrajectoryReader {
+public:
+    DcdReader(const string& filename, int numParticles, const Vec3* defaultBox) : file(filename), numAtoms(0) {
+        for (int i = 0; i < 3; i++)
+            this->defaultBox[i] = defaultBox[i];
+        const char* data = file.getData();
+        size_t offset = 0;
+        if (file.getSize() < 92 || readInt(offset) != 84 || memcmp(data+4, "CORD", 4) != 0)
+            throw OpenMMException("Unsupported DCD file: "+filename+".  Only native byte order DCD files are supported.");
+        int control[20];
+        memcpy(control, data+8, sizeof(control));
+        offset = 92;
+        bool charmm = (control[19] != 0);
+        hasUnitCell = (charmm && control[10] != 0);
+        if (control[8] != 0 || (charmm && control[11] != 0))
+            throw OpenMMException("Unsupported DCD file: "+filename+".  Fixed atoms and 4D coordinates are not supported.");
+        int titleSize = readInt(offset);
+        offset += titleSize;
+        if (readInt(offset) != titleSize || readInt(offset) != 4)
+            throw OpenMMException("Error reading DCD file: "+filename);
+        numAtoms = readInt(offset);
+        offset += 4;
+        if (numAtoms != numParticles)
+            throw OpenMMException("The number of atoms in the DCD file does not match the System");
+        headerSize = offset;
+        frameSize = (hasUnitCell ? 56 : 0) + 3*(8+4*(size_t) numAtoms);
+
+        // The frame count in the header is not updated if a simulation is interrupted, so compute it
+        // from the file size instead.
+
+        numFrames = (file.getSize() > headerSize ? (file.getSize()-headerSize)/frameSize : 0);
+    }
+    long long getNumFrames() const {
+        return numFrames;
+    }
+    void readFrame(long long frame, vector<Vec3>& positions, Vec3* box) const {
+        size_t offset = headerSize+frame*frameSize;
+        if (hasUnitCell) {
+            // The unit cell is stored as A, gamma, B, beta, alpha, C.  Angles are stored either as cosines
+            // or in degrees, depending on the program that wrote the file.
+
+            double cell[6];
+            memcpy(cell, file.getData()+offset+4, sizeof(cell));
+            offset += 56;
+            double cosines[3];
+            for (int i = 0; i < 3; i++) {
+                double angle = cell[i == 0 ? 4 : (i == 1 ? 3 : 1)];
+                cosines[i] = (fabs(angle) <= 1.0 ? angle : cos(angle*M_PI/180.0));
+            }
+            computeBoxVectors(0.1*cell[0], 0.1*cell[2], 0.1*cell[5], cosines[0], cosines[1], cosines[2], box);
+        }
+        else
+            for (int i = 0; i < 3; i++)
+                box[i] = defaultBox[i];
+        positions.resize(numAtoms);
+        vector<float> coords(numAtoms);
+        for (int axis = 0; axis < 3; axis++) {
+            memcpy(coords.data(), file.getData()+offset+4, 4*numAtoms);
+            offset += 8+4*numAtoms;
+            for (int i = 0; i < numAtoms; i++)
+                positions[i][axis] = 0.1*coords[i];
+        }
+    }
+private:
+    int readInt(size_t& offset) const {
+        int32_t value;
+        memcpy(&value, file.getData()+offset, 4);
+        offset += 4;
+        return value;
+    }
+    MappedFile file;
+    int numAtoms;
+    bool hasUnitCell;
+    size_t headerSize, frameSize;
+    long long numFrames;
+    Vec3 defaultBox[3];
+};
+
+/**
+ * Reads frames from a raw stream of doubles.
+ */
+class RawReader : public TrajectoryReader {
+public:
+    RawReader(const string& filename, int numParticles) : file(filename), numAtoms(numParticles) {
+        frameSize = 8*(9+3*(size_t) numAtoms);
+        if (file.getSize()%frameSize != 0)
+            throw OpenMMException("The size of the raw trajectory file is not a multiple of the frame size");
+        numFrames = file.getSize()/frameSize;
+    }
+    long long getNumFrames() const {
+        return numFrames;
+    }
+    void readFrame(long long frame, vector<Vec3>& positions, Vec3* box) const {
+        const char* data = file.getData()+frame*frameSize;
+        vector<double> values(9+3*numAtoms);
+        memcpy(values.data(), data, frameSize);
+        for (int i = 0; i < 3; i++)
+            box[i] = Vec3(values[3*i], values[3*i+1], values[3*i+2]);
+        positions.resize(numAtoms);
+        for (int i = 0; i < numAtoms; i++)
+            positions[i] = Vec3(values[9+3*i], values[9+3*i+1], values[9+3*i+2]);
+    }
+private:
+    MappedFile file;
+    int numAtoms;
+    size_t frameSize;
+    long long numFrames;
+};
+
+/**
+ * Write a block of data at a specific position in a file.
+ */
+void writeAt(int fd, const void* data, size_t size, off_t offset) {
+    const char* bytes = (const char*) data;
+    while (size > 0) {
+        ssize_t written = pwrite(fd, bytes, size, offset);
+        if (written <= 0)
+            throw OpenMMException("Error writing output file");
+        bytes += written;
+        size -= written;
+        offset += written;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4 || argc > 5) {
+        cout << "Usage: XtbRescore <system.xml> <trajectory> <output> [number of threads]" << endl;
+        return 1;
+    }
+    try {
+        // Load the System and remove everything except the XtbForce.
+
+        ifstream systemFile(argv[1]);
+        if (!systemFile.is_open())
+            throw OpenMMException(string("Could not open System file: ")+argv[1]);
+        unique_ptr<System> system(XmlSerializer::deserialize<System>(systemFile));
+        XtbForce* force = nullptr;
+        for (int i = system->getNumForces()-1; i >= 0; i--) {
+            XtbForce* xtb = dynamic_cast<XtbForce*>(&system->getForce(i));
+            if (xtb != nullptr && force == nullptr)
+                force = xtb;
+            else
+                system->removeForce(i);
+        }
+        if (force == nullptr)
+            throw OpenMMException("The System does not contain an XtbForce");
+        int numParticles = system->getNumParticles();
+        int numAtoms = force->getParticleIndices().size();
+
+        // Open the trajectory.
+
+        string trajectoryName = argv[2];
+        unique_ptr<TrajectoryReader> reader;
+        if (trajectoryName.size() > 4 && trajectoryName.substr(trajectoryName.size()-4) == ".dcd") {
+            Vec3 defaultBox[3];
+            system->getDefaultPeriodicBoxVectors(defaultBox[0], defaultBox[1], defaultBox[2]);
+            reader.reset(new DcdReader(trajectoryName, numParticles, defaultBox));
+        }
+        else
+            reader.reset(new RawReader(trajectoryName, numParticles));
+        long long numFrames = reader->getNumFrames();
+
+        // Create the output file and write the header.
+
+        const int headerSize = 32;
+        const int64_t recordSize = 8*(1+4*(int64_t) numAtoms);
+        int fd = open(argv[3], O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            throw OpenMMException(string("Could not create output file: ")+argv[3]);
+        char header[headerSize];
+        int32_t version = 1, headerAtoms = numAtoms;
+        int64_t headerFrames = numFrames;
+        memcpy(header, "XTBSCORE", 8);
+        memcpy(header+8, &version, 4);
+        memcpy(header+12, &headerAtoms, 4);
+        memcpy(header+16, &headerFrames, 8);
+        memcpy(header+24, &recordSize, 8);
+        if (ftruncate(fd, headerSize+numFrames*recordSize) != 0) {
+            close(fd);
+            throw OpenMMException("Could not allocate output file");
+        }
+        writeAt(fd, header, headerSize, 0);
+
+        // Evaluate the frames in parallel.  Each thread has its own Context, and therefore its own XTB
+        // objects that persist from one frame to the next.  Threads take frames in order, so the
+        // trajectory is read roughly sequentially and each calculation starts from the wavefunction of
+        // a nearby frame.
+        //
+        // XTB parallelizes each calculation with OpenMP, which reads OMP_NUM_THREADS when the program
+        // starts, so it is too late to change it here.  By default we use a single thread and let XTB use
+        // every processor.  Running several threads without limiting XTB would start one OpenMP thread per
+        // processor for every one of them.
+
+        int numThreads = (argc > 4 ? atoi(argv[4]) : 1);
+        if (numThreads < 1)
+            throw OpenMMException("The number of threads must be at least 1");
+        if (numThreads > 1 && getenv("OMP_NUM_THREADS") == nullptr)
+            cout << "Warning: OMP_NUM_THREADS is not set, so each of the " << numThreads << " threads will run XTB on every processor.  "
+                    "Set OMP_NUM_THREADS=1 to avoid oversubscribing the CPU." << endl;
+        ThreadPool threads(numThreads);
+        atomic<long long> nextFrame(0);
+        atomic<bool> failed(false);
+        mutex errorLock;
+        string error;
+        auto start = chrono::steady_clock::now();
+        threads.execute([&] (ThreadPool& pool, int threadIndex) {
+            try {
+                VerletIntegrator integrator(0.001);
+                Context context(*system, integrator, Platform::getPlatformByName("Reference"));
+                vector<Vec3> positions;
+                vector<double> record(1+4*numAtoms), charges;
+                Vec3 box[3];
+                while (!failed) {
+                    long long frame = nextFrame++;
+                    if (frame >= numFrames)
+                        break;
+                    reader->readFrame(frame, positions, box);
+                    context.setPeriodicBoxVectors(box[0], box[1], box[2]);
+                    context.setPositions(positions);
+                    State state = context.getState(State::Energy | State::Forces);
+                    force->getChargesInContext(context, charges);
+                    const vector<Vec3>& forces = state.getForces();
+                    const vector<int>& indices = force->getParticleIndices();
+                    record[0] = state.getPotentialEnergy();
+                    for (int i = 0; i < numAtoms; i++) {
+                        for (int j = 0; j < 3; j++)
+                            record[1+3*i+j] = forces[indices[i]][j];
+                        record[1+3*numAtoms+i] = charges[i];
+                    }
+                    writeAt(fd, record.data(), recordSize, headerSize+frame*recordSize);
+                }
+            }
+            catch (const exception& e) {
+                lock_guard<mutex> lock(errorLock);
+                if (!failed)
+                    error = e.what();
+                failed = true;
+            }
+        });
+        threads.waitForThreads();
+        close(fd);
+        if (failed)
+            throw OpenMMException(error);
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+        cout << "Processed " << numFrames << " frames in " << elapsed << " s using " << numThreads << " threads";
+        if (numFrames > 0 && elapsed > 0)
+            cout << " (" << numFrames/elapsed << " frames/s, " << 1000*elapsed/numFrames << " ms/frame)";
+        cout << endl;
+    }
+    catch (const exception& e) {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,243 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2023 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This tests the XtbRescore program.  It writes a small trajectory in each of the supported formats, runs
+ * the program on it, and compares the output to values computed directly with a Context.
+ *
+ * Usage: TestXtbRescore [path to XtbRescore]
+ *
+ * If no path is given, it runs the XtbRescore built alongside it.
+ */
+
+#include "XtbForce.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "openmm/Context.h"
+#include "openmm/Platform.h"
+#include "openmm/System.h"
+#include "openmm/VerletIntegrator.h"
+#include "openmm/serialization/XmlSerializer.h"
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace XtbPlugin;
+using namespace OpenMM;
+using namespace std;
+
+const string systemFile = "TestXtbRescoreSystem.xml";
+const string rawFile = "TestXtbRescore.raw";
+const string dcdFile = "TestXtbRescore.dcd";
+const string outputFile = "TestXtbRescore.bin";
+
+struct Frame {
+    Vec3 box[3];
+    vector<Vec3> positions;
+};
+
+template <class T>
+void writeValue(ofstream& out, T value) {
+    out.write((const char*) &value, sizeof(T));
+}
+
+void writeRaw(const vector<Frame>& frames) {
+    ofstream out(rawFile, ios::binary);
+    for (const Frame& frame : frames) {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                writeValue<double>(out, frame.box[i][j]);
+        for (const Vec3& pos : frame.positions)
+            for (int j = 0; j < 3; j++)
+                writeValue<double>(out, pos[j]);
+    }
+}
+
+/**
+ * Write a DCD file with a unit cell.  The first frame stores the angles in degrees and the others store
+ * their cosines, since different programs use different conventions.
+ */
+void writeDcd(const vector<Frame>& frames) {
+    ofstream out(dcdFile, ios::binary);
+    int numAtoms = frames[0].positions.size();
+    writeValue<int32_t>(out, 84);
+    out.write("CORD", 4);
+    int32_t control[20] = {0};
+    control[0] = frames.size();
+    control[10] = 1;
+    control[19] = 24;
+    out.write((const char*) control, sizeof(control));
+    writeValue<int32_t>(out, 84);
+    char title[80];
+    memset(title, ' ', sizeof(title));
+    writeValue<int32_t>(out, 84);
+    writeValue<int32_t>(out, 1);
+    out.write(title, sizeof(title));
+    writeValue<int32_t>(out, 84);
+    writeValue<int32_t>(out, 4);
+    writeValue<int32_t>(out, numAtoms);
+    writeValue<int32_t>(out, 4);
+    for (int i = 0; i < frames.size(); i++) {
+        const Frame& frame = frames[i];
+        double angle = (i == 0 ? 90.0 : 0.0);
+        double cell[6] = {10*frame.box[0][0], angle, 10*frame.box[1][1], angle, angle, 10*frame.box[2][2]};
+        writeValue<int32_t>(out, 48);
+        out.write((const char*) cell, sizeof(cell));
+        writeValue<int32_t>(out, 48);
+        for (int axis = 0; axis < 3; axis++) {
+            writeValue<int32_t>(out, 4*numAtoms);
+            for (const Vec3& pos : frame.positions)
+                writeValue<float>(out, (float) (10*pos[axis]));
+            writeValue<int32_t>(out, 4*numAtoms);
+        }
+    }
+}
+
+/**
+ * Run XtbRescore and return the records it wrote.
+ */
+vector<double> runRescore(const string& program, const string& trajectory, int numThreads, int numAtoms, int numFrames) {
+    string command = "OMP_NUM_THREADS=1 \""+program+"\" "+systemFile+" "+trajectory+" "+outputFile+" "+to_string(numThreads);
+    ASSERT_EQUAL(0, system(command.c_str()));
+    ifstream in(outputFile, ios::binary);
+    char magic[8];
+    int32_t version, headerAtoms;
+    int64_t headerFrames, recordSize;
+    in.read(magic, 8);
+    in.read((char*) &version, 4);
+    in.read((char*) &headerAtoms, 4);
+    in.read((char*) &headerFrames, 8);
+    in.read((char*) &recordSize, 8);
+    ASSERT(memcmp(magic, "XTBSCORE", 8) == 0);
+    ASSERT_EQUAL(1, version);
+    ASSERT_EQUAL(numAtoms, headerAtoms);
+    ASSERT_EQUAL(numFrames, headerFrames);
+    ASSERT_EQUAL(8*(1+4*numAtoms), recordSize);
+    vector<double> records(numFrames*(1+4*numAtoms));
+    in.read((char*) records.data(), 8*records.size());
+    ASSERT(in.good());
+    in.get();
+    ASSERT(in.eof());
+    return records;
+}
+
+/**
+ * Compare the records written by XtbRescore to the results from a Context.
+ */
+void checkRecords(const vector<double>& records, Context& context, const XtbForce& force, const vector<Frame>& frames) {
+    int numAtoms = force.getParticleIndices().size();
+    for (int i = 0; i < frames.size(); i++) {
+        const Frame& frame = frames[i];
+        context.setPeriodicBoxVectors(frame.box[0], frame.box[1], frame.box[2]);
+        context.setPositions(frame.positions);
+        State state = context.getState(State::Energy | State::Forces);
+        vector<double> charges;
+        force.getChargesInContext(context, charges);
+        const double* record = &records[i*(1+4*numAtoms)];
+        ASSERT_EQUAL_TOL(state.getPotentialEnergy(), record[0], 1e-6);
+        for (int j = 0; j < numAtoms; j++) {
+            int index = force.getParticleIndices()[j];
+            ASSERT_EQUAL_VEC(state.getForces()[index], Vec3(record[1+3*j], record[2+3*j], record[3+3*j]), 1e-6);
+            ASSERT_EQUAL_TOL(charges[j], record[1+3*numAtoms+j], 1e-6);
+        }
+    }
+}
+
+void testRescore(const string& program) {
+    // Create a periodic system with two water molecules.  The third particle is not part of the XtbForce.
+
+    System system;
+    system.addParticle(16.0);
+    system.addParticle(1.0);
+    system.addParticle(1.0);
+    system.addParticle(1.0);
+    system.setDefaultPeriodicBoxVectors(Vec3(2.0, 0, 0), Vec3(0, 2.0, 0), Vec3(0, 0, 2.0));
+    XtbForce* force = new XtbForce(XtbForce::GFNFF, 0.0, 1, true, {0, 1, 2}, {8, 1, 1});
+    system.addForce(force);
+    ofstream out(systemFile);
+    XmlSerializer::serialize<System>(&system, "System", out);
+    out.close();
+
+    // Create two frames with different positions and box sizes.  Round the positions to the single
+    // precision Angstroms stored in the DCD file so both formats describe the same frames.
+
+    vector<Frame> frames(2);
+    for (int i = 0; i < 2; i++) {
+        double size = 2.0+0.1*i;
+        frames[i].box[0] = Vec3(size, 0, 0);
+        frames[i].box[1] = Vec3(0, size, 0);
+        frames[i].box[2] = Vec3(0, 0, size);
+        frames[i].positions = {Vec3(0.5, 0.5, 0.5), Vec3(0.5957+0.01*i, 0.5, 0.5), Vec3(0.476, 0.5927, 0.5), Vec3(1.2, 1.2, 1.2)};
+        for (Vec3& pos : frames[i].positions)
+            for (int j = 0; j < 3; j++)
+                pos[j] = 0.1*(float) (10*pos[j]);
+    }
+    writeRaw(frames);
+    writeDcd(frames);
+
+    // Rescore both trajectories and compare the results to a Context.
+
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, Platform::getPlatformByName("Reference"));
+    checkRecords(runRescore(program, rawFile, 2, 3, 2), context, *force, frames);
+    checkRecords(runRescore(program, dcdFile, 1, 3, 2), context, *force, frames);
+
+    // An empty trajectory should produce an output file with no records.
+
+    ofstream empty(rawFile, ios::binary);
+    empty.close();
+    runRescore(program, rawFile, 1, 3, 0);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 2) {
+        cout << "Usage: TestXtbRescore [path to XtbRescore]" << endl;
+        return 1;
+    }
+    int result = 0;
+    try {
+        testRescore(argc == 2 ? argv[1] : XTB_RESCORE_PATH);
+    }
+    catch(const std::exception& e) {
+        std::cout << "exception: " << e.what() << std::endl;
+        result = 1;
+    }
+    for (const string& file : {systemFile, rawFile, dcdFile, outputFile})
+        remove(file.c_str());
+    if (result == 0)
+        std::cout << "Done" << std::endl;
+    return result;
+}